@@ -1,14 +1,16 @@
-
-
-
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <stack>
+#include <vector>
+#include <string>
 #include <cstdlib>
 #include <cmath>
 #include <ctime>
+#include <cstdio>
+#include <mutex>
 #include "bitmap.hpp"
+#include "1905109_renderer.h"
 
 #ifdef __APPLE__
 #define GL_SILENCE_DEPRECATION
@@ -24,554 +26,529 @@
 #endif
 
 
-#define pi (2*acos(0.0))
-#define dim 4L
-#define GAP ' '
+using namespace std;
+using namespace offline2;
 
 
-using namespace std;
+struct Paths {
+    string scene, config, image, zBuffer, views, edits;
+    DepthFormat zBufferFormat;
+
+    Paths() {
+        scene = "scene.txt";
+        config = "config.txt";
+        image = "out.bmp";
+        zBuffer = "z_buffer.txt";
+        zBufferFormat = DEPTH_TEXT;
+    }
+};
 
 
-static unsigned long int g_seed = 1;
-inline int randoms() {
-    g_seed = (214013 * g_seed + 2531011);
-    return (g_seed >> 16) & 0x7FFF;
+void usage(const char *prog) {
+    cerr << "usage: " << prog << " [options]\n"
+         << "  -i, --scene FILE          scene to render (scene.txt)\n"
+         << "  -g, --config FILE         screen size (config.txt)\n"
+         << "  -o, --output FILE         image to write (out.bmp)\n"
+         << "  -z, --zbuffer FILE        depth values to write (z_buffer.txt)\n"
+         << "  --zbuffer-format F        text, raw (float32 with a header), pfm or bmp\n"
+         << "                            (jet colormap); z_buffer gets that extension\n"
+         << "                            unless -z is given\n"
+         << "  -v, --views FILE          render every camera in FILE from one modeling pass\n"
+         << "  -e, --edits FILE          render, then apply each edit (object index and a\n"
+         << "                            translate, scale or rotate) and redraw only the\n"
+         << "                            tiles it changes; frames go to numbered files\n"
+         << "  --stream                  read and rasterize the scene in chunks, for\n"
+         << "                            scenes too big for memory\n"
+         << "  --chunk N                 triangles per streamed chunk (65536)\n"
+         << "  --cache DIR               keep the compiled scene in DIR and reuse it\n"
+         << "                            while scene.txt and its obj files are unchanged\n"
+         << "  --parallel-views          render the views of -v concurrently\n"
+         << "  -d, --dump-stages         also write stage1/2/3\n"
+         << "  --stage-prefix PREFIX     prepended to the stage file names\n"
+         << "  --stage-format F          text, binary or binary32\n"
+         << "  --convert IN OUT          convert a stage dump between text and binary\n"
+         << "  -s, --stats               print render statistics\n"
+         << "  --stats-format F          text or json\n"
+         << "  -t, --threads N           raster threads\n"
+         << "  --seed N                  seed of the per-triangle colors (1)\n"
+         << "  --sort                    rasterize front to back (with -s the unsorted\n"
+         << "                            frame is rendered too, to compare overdraw)\n"
+         << "  -m, --msaa N              depth samples per pixel: 1, 2, 4 or 8 (with -s\n"
+         << "                            the frame is rendered at 1x too, to compare)\n"
+         << "  -c, --cull MODE           none, back or front\n"
+         << "  --depth TYPE              float or double depth buffer\n"
+         << "  --bench N                 time transforming N vertices point by point\n"
+         << "                            and batched, then exit" << endl;
 }
 
 
-struct Point {
-    double x, y, z, n;
+enum StatsFormat { STATS_NONE, STATS_TEXT, STATS_JSON };
 
-    Point() {
-        x = y = z = 0;
-        n = 1;
-    }
-    Point(double x, double y, double z) {
-        this->x = x;
-        this->y = y;
-        this->z = z;
-        this->n = 1;
-    }
-    Point(double x, double y, double z, double n) {
-        this->x = x;
-        this->y = y;
-        this->z = z;
-        this->n = n;
-    }
-    Point(const Point &p) {
-        this->x = p.x;
-        this->y = p.y;
-        this->z = p.z;
-        this->n = p.n;
-    }
 
-    Point operator +(Point p) {
-        return Point(x+p.x, y+p.y, z+p.z);
-    }
-    Point operator -(Point p) {
-        return Point(x-p.x, y-p.y, z-p.z);
-    }
-    Point operator *(double c) {
-        return Point(x*c, y*c, z*c);
-    }
-    Point operator /(double c) {
-        return Point(x/c, y/c, z/c);
-    }
-    Point operator ^(Point p) {
-        return Point(y*p.z - z*p.y, z*p.x - x*p.z, x*p.y - y*p.x);
+void printStats(RenderStats &stats, StatsFormat format, int view = -1, const char *tag = "view") {
+    if (format == STATS_TEXT) stats.print(cout);
+    else if (format == STATS_JSON) stats.printJson(cout, view, tag);
+}
+
+
+template <typename T, typename S>
+void run(S &scene, Config &config, RenderOptions &opt, Paths &paths, RenderStats &parse, StatsFormat statsFormat) {
+    RenderResult<T> result;
+
+#if RENDER_STATS
+    // reference frames for the before/after figures
+    RenderStats unsorted, single;
+    RenderOptions reference = opt;
+    reference.dumpStages = false;
+    if (opt.sortFrontToBack && statsFormat != STATS_NONE) {
+        reference.sortFrontToBack = false;
+        render(scene, config, reference, result);
+        unsorted = result.stats;
+        reference.sortFrontToBack = opt.sortFrontToBack;
     }
-    double operator *(Point p) {
-        return (x*p.x + y*p.y + z*p.z);
+    if (opt.samples > 1 && statsFormat != STATS_NONE) {
+        reference.samples = 1;
+        render(scene, config, reference, result);
+        single = result.stats;
     }
+#endif
 
-    double length() {
-        return sqrt(x*x + y*y + z*z);
-    }
+    render(scene, config, opt, result);
+    result.stats.seconds[STAT_PARSE] = parse.seconds[STAT_PARSE];
+    STAT(result.stats.unsortedFragmentsPassed = unsorted.fragmentsPassed);
+    STAT(result.stats.baselineFrameBytes = single.frameBytes);
+    STAT(result.stats.baselineSeconds = single.pixelSeconds());
 
-    void normalize() {
-        double len = length();
-        x /= len;
-        y /= len;
-        z /= len;
+    {
+        STAT_TIME(result.stats, STAT_OUTPUT);
+        result.image.save_image(paths.image);
+        writeDepth(paths.zBuffer.c_str(), result.depth, paths.zBufferFormat);
     }
 
-    void scale() {
-        x /= n;
-        y /= n;
-        z /= n;
-        n = 1;
-    }
+    printStats(result.stats, statsFormat);
+}
 
-    
-    void setPoint(Point &p) {
-        this->x = p.x;
-        this->y = p.y;
-        this->z = p.z;
-        this->n = p.n;
-    }
-    void setPoint(double x, double y, double z) {
-        this->x = x;
-        this->y = y;
-        this->z = z;
-        this->n = 1;
-    }
-    void setPoint(double x, double y, double z, double n) {
-        this->x = x;
-        this->y = y;
-        this->z = z;
-        this->n = n;
+
+template <typename T>
+bool runStream(Config &config, RenderOptions &opt, Paths &paths, size_t chunk, RenderStats &parse, StatsFormat statsFormat) {
+    RenderResult<T> result;
+    if (!renderStream(paths.scene.c_str(), config, opt, result, chunk)) return false;
+    result.stats.seconds[STAT_PARSE] = parse.seconds[STAT_PARSE];
+
+    {
+        STAT_TIME(result.stats, STAT_OUTPUT);
+        result.image.save_image(paths.image);
+        writeDepth(paths.zBuffer.c_str(), result.depth, paths.zBufferFormat);
     }
 
-};
+    printStats(result.stats, statsFormat);
+    return true;
+}
 
-struct Triangle{
-    Point points[3];
-    int col[3];
 
-    Triangle() {
-        col[0] = randoms()%255+1;
-        col[1] = randoms()%255+1;
-        col[2] = randoms()%255+1;
-    }
+// out.bmp, 7 -> out_0007.bmp
+string indexedName(string &name, int index) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04d", index);
 
-    Triangle(Point p, Point q, Point r) {
-        points[0] = p;
-        points[1] = q;
-        points[2] = r;
-        col[0] = randoms()%255+1;
-        col[1] = randoms()%255+1;
-        col[2] = randoms()%255+1;
-    }
+    size_t dot = name.rfind('.');
+    if (dot == string::npos || name.find('/', dot) != string::npos) return name + suffix;
+    return name.substr(0, dot) + suffix + name.substr(dot);
+}
 
-    void setPoints(Point p, Point q, Point r) {
-        points[0] = p;
-        points[1] = q;
-        points[2] = r;
-    }
-};
 
+template <typename T, typename S>
+void runViews(S &scene, vector<View> &views, RenderOptions &opt, Paths &paths, bool parallelViews, RenderStats &shared, StatsFormat statsFormat) {
+    vector<Triangle> world;
+    {
+        STAT_TIME(shared, STAT_MODELING);
+        buildWorld(scene, world, opt.colorSeed);
+    }
 
-struct Matrix{
-    double mat[dim][dim];
+    // parsing and modeling happen once, so they are reported apart from the views
+    if (statsFormat == STATS_TEXT) cout << "shared\n";
+    printStats(shared, statsFormat);
 
-    Matrix() {
-        for (int i = 0; i < dim; i++) {
-            for (int j = 0; j < dim; j++) {
-                mat[i][j] = 0;
-            }
+    mutex printLock;
+    renderViews<T>(world, views, opt, parallelViews, [&](int v, RenderResult<T> &result) {
+        {
+            STAT_TIME(result.stats, STAT_OUTPUT);
+            result.image.save_image(indexedName(paths.image, v));
+            writeDepth(indexedName(paths.zBuffer, v).c_str(), result.depth, paths.zBufferFormat);
         }
-    }
 
-    Matrix operator*(Matrix p) {
-        Matrix ret;
-        for (int i = 0; i < dim; i++) {
-            for (int j = 0; j < dim; j++) {
-                for (int k = 0; k < dim; k++) {
-                    ret.mat[i][j] += mat[i][k]*p.mat[k][j];
-                }
-            }
+        if (statsFormat != STATS_NONE) {
+            lock_guard<mutex> guard(printLock);
+            if (statsFormat == STATS_TEXT) cout << "view " << v << '\n';
+            printStats(result.stats, statsFormat, v);
         }
-        return ret;
-    }
+    });
+}
 
-    Point operator*(Point p) {
-        Point ret;
-        double c[dim] = {0};
-        double pArr[dim] = {p.x, p.y, p.z, p.n};
 
-        for (int i = 0; i < dim; i++) {
-            for (int j = 0; j < dim; j++) {
-                c[i] += mat[i][j]*pArr[j];
-            }
+// Renders the scene as loaded and then again after every edit, all into
+// one retained frame. Frame 0 is the scene as loaded, frame i follows
+// edit i-1.
+template <typename T>
+bool runEdits(Scene &scene, Config &config, vector<Edit> &edits, RenderOptions &opt, Paths &paths, RenderStats &parse, StatsFormat statsFormat) {
+    vector<Triangle> world;
+    vector<size_t> objects;
+    {
+        STAT_TIME(parse, STAT_MODELING);
+        buildObjects(scene, world, objects, opt.colorSeed);
+    }
+    for (Edit &e : edits) {
+        if (e.object >= (int)objects.size()-1) {
+            cerr << "no object " << e.object << " in " << paths.scene << endl;
+            return false;
         }
-
-        ret.setPoint(c[0], c[1], c[2], c[3]);
-        ret.scale();
-        return ret;
     }
 
-    void identity() {
-        for (int i = 0; i < dim; i++) {
-            for (int j = 0; j < dim; j++) {
-                if (i == j) {
-                    mat[i][j] = 1;
-                    continue;
-                }
-                mat[i][j] = 0;
-            }
+    View view = {scene.camera, config};
+    RetainedFrame<T> frame(world, objects, view, opt);
+    auto output = [&](int f) {
+        RenderResult<T> &result = frame.result;
+        {
+            STAT_TIME(result.stats, STAT_OUTPUT);
+            result.image.save_image(indexedName(paths.image, f));
+            writeDepth(indexedName(paths.zBuffer, f).c_str(), result.depth, paths.zBufferFormat);
         }
-    }
 
-    void translation(Point p) {
-        identity();
-        mat[0][3] = p.x;
-        mat[1][3] = p.y;
-        mat[2][3] = p.z;
-    }
+        if (statsFormat == STATS_TEXT) cout << "frame " << f << '\n';
+        printStats(result.stats, statsFormat, f, "frame");
+    };
 
-    void scaling(Point p) {
-        identity();
-        mat[0][0] = p.x;
-        mat[1][1] = p.y;
-        mat[2][2] = p.z;
+    frame.render();
+    frame.result.stats.seconds[STAT_PARSE] = parse.seconds[STAT_PARSE];
+    frame.result.stats.seconds[STAT_MODELING] += parse.seconds[STAT_MODELING];
+    output(0);
+    for (size_t i = 0; i < edits.size(); i++) {
+        Matrix m = commandMatrix(edits[i].c);
+        frame.edit(edits[i].object, m);
+        output(i+1);
     }
+    return true;
+}
 
-    Point rodrigues(Point p, Point axis, double angle) {
-        double theta = angle*pi/180;
-        return p*cos(theta) + axis*(axis*p)*(1-cos(theta)) + (axis^p)*sin(theta);   
-    }
 
-    void rotate(Point axis, double angle) {
-        identity();
-        Point a = axis;
-        a.normalize();
-        
-        Point x(1, 0, 0), y(0, 1, 0), z(0, 0, 1);
-        x = rodrigues(x, a, angle);
-        y = rodrigues(y, a, angle);
-        z = rodrigues(z, a, angle);
-
-        mat[0][0] = x.x;
-        mat[1][0] = x.y;
-        mat[2][0] = x.z;
-        mat[0][1] = y.x;
-        mat[1][1] = y.y;
-        mat[2][1] = y.z;
-        mat[0][2] = z.x;
-        mat[1][2] = z.y;
-        mat[2][2] = z.z;
+// The transform as Matrix had it before the batched kernel: matrix and
+// point by value, summed in loops. Kept for --bench to compare against.
+Point loopTransform(Matrix m, Point p) {
+    double c[dim] = {0};
+    double pArr[dim] = {p.x, p.y, p.z, p.n};
+    for (int i = 0; i < dim; i++) {
+        for (int j = 0; j < dim; j++) {
+            c[i] += m.mat[i][j]*pArr[j];
+        }
     }
+    return Point(c[0], c[1], c[2], c[3]);
+}
 
-
-    void viewMatrix(Point cam, Point look, Point up) {
-        identity();
-        Point z = look-cam; z.normalize();
-        Point x = z^up; x.normalize();
-        Point y = x^z; y.normalize(); 
-
-        mat[0][0] = x.x;
-        mat[0][1] = x.y;
-        mat[0][2] = x.z;
-        mat[1][0] = y.x;
-        mat[1][1] = y.y;
-        mat[1][2] = y.z;
-        mat[2][0] = -z.x;
-        mat[2][1] = -z.y;
-        mat[2][2] = -z.z;
-
-        Matrix m;
-        m.translation(Point(-cam.x, -cam.y, -cam.z));
-
-        m = m*(*this);
-        *this = m;
+// Transforms n random points by a model-view-projection matrix three ways,
+// best of five runs each, and reports how far apart the results are.
+void bench(size_t n) {
+    PointArray in;
+    vector<Point> points(n);
+    for (size_t v = 0; v < n; v++) {
+        points[v] = Point((mix64(v*3) >> 11)*0x1p-53*200 - 100, (mix64(v*3+1) >> 11)*0x1p-53*200 - 100,
+                          (mix64(v*3+2) >> 11)*0x1p-53*200 - 100);
+        in.push_back(points[v]);
+    }
+
+    Matrix model, view, projection;
+    model.rotate(Point(1, 2, 3), 30);
+    view.viewMatrix(Point(0, 0, 200), Point(0, 0, 0), Point(0, 1, 0));
+    projection.projectionMatrix(80, 1, 1, 500);
+    Matrix m = projection*view*model;
+
+    vector<Point> loop(n), single(n);
+    PointArray batched;
+    double best[3] = {1e30, 1e30, 1e30};
+    for (int run = 0; run < 5; run++) {
+        double seconds[3] = {0, 0, 0};
+        {
+            StageTimer timer(seconds[0]);
+            for (size_t v = 0; v < n; v++) loop[v] = loopTransform(m, points[v]);
+        }
+        {
+            StageTimer timer(seconds[1]);
+            for (size_t v = 0; v < n; v++) single[v] = m.transform(points[v]);
+        }
+        {
+            StageTimer timer(seconds[2]);
+            m.transform(in, 0, n, batched);
+        }
+        for (int k = 0; k < 3; k++) best[k] = min(best[k], seconds[k]);
     }
 
-    void projectionMatrix(double fovY, double aspect, double near, double far) {
-        identity();
-        double fovX = fovY*aspect;
-        double angleR = (fovX/2)*pi/180;
-        double r = near*tan(angleR);
-        double angleT = (fovY/2)*pi/180;
-        double t = near*tan(angleT);
-
-        mat[0][0] = near/r;
-        mat[1][1] = near/t;
-        mat[2][2] = -(far+near)/(far-near);
-        mat[3][2] = -1;
-        mat[2][3] = -2*far*near/(far-near);
-        mat[3][3] = 0;
+    double loopDiff = 0, batchDiff = 0;
+    for (size_t v = 0; v < n; v++) {
+        Point b = batched[v];
+        double c[3][4] = {{loop[v].x, loop[v].y, loop[v].z, loop[v].n},
+                          {single[v].x, single[v].y, single[v].z, single[v].n}, {b.x, b.y, b.z, b.n}};
+        for (int i = 0; i < 4; i++) {
+            loopDiff = max(loopDiff, fabs(c[0][i]-c[1][i]));
+            batchDiff = max(batchDiff, fabs(c[2][i]-c[1][i]));
+        }
     }
 
-    
-};
-
-
-
-/////////
-
-
-int main() {
-    ifstream in;
-    in.open("scene.txt");
-    ofstream out;
-    out.open("stage1.txt");
-
-    Point cam, look, up;
-    in >> cam.x >> cam.y >> cam.z;
-    in >> look.x >> look.y >> look.z;
-    in >> up.x >> up.y >> up.z;
+    const char *names[3] = {"loops, by value", "per point", "batched"};
+    cout << n << " vertices, best of 5\n" << fixed;
+    for (int k = 0; k < 3; k++) {
+        cout << setw(16) << left << names[k] << right << setprecision(3) << setw(10) << best[k]*1e3 << " ms"
+             << setprecision(1) << setw(10) << n/best[k]*1e-6 << " Mvertices/s\n";
+    }
+    cout << defaultfloat << "largest difference from per point: loops " << loopDiff << ", batched " << batchDiff << endl;
+}
 
-    double fovY, aspect, near, far;
-    in >> fovY >> aspect >> near >> far;
 
-    stack<Matrix> st;
-    Matrix mat1;
-    mat1.identity();
-    st.push(mat1);
+// Renders a parsed Scene or a compiled SceneProgram, one frame or one per
+// view.
+template <typename S>
+int runScene(S &scene, Paths &paths, RenderOptions &opt, bool floatDepth, bool parallelViews, RenderStats &parse, StatsFormat statsFormat) {
+    if (!paths.views.empty()) {
+        vector<View> views;
+        if (!loadViews(paths.views.c_str(), views)) {
+            cerr << "cannot read views " << paths.views << endl;
+            return 1;
+        }
 
-    int count = 0;
+        if (floatDepth) runViews<float>(scene, views, opt, paths, parallelViews, parse, statsFormat);
+        else runViews<double>(scene, views, opt, paths, parallelViews, parse, statsFormat);
+        return 0;
+    }
 
-    while (true) {
-        string s;
-        in >> s;
+    // a missing config keeps the default 100x100 screen
+    Config config;
+    {
+        STAT_TIME(parse, STAT_PARSE);
+        loadConfig(paths.config.c_str(), config);
+    }
 
-        if (s == "triangle") {
-            Point p1, p2, p3;
-            in >> p1.x >> p1.y >> p1.z;
-            in >> p2.x >> p2.y >> p2.z;
-            in >> p3.x >> p3.y >> p3.z;
+    if (floatDepth) run<float>(scene, config, opt, paths, parse, statsFormat);
+    else run<double>(scene, config, opt, paths, parse, statsFormat);
 
-            p1 = st.top()*p1;
-            p2 = st.top()*p2; 
-            p3 = st.top()*p3;
+    return 0;
+}
 
-            out << setprecision(6) << fixed;
-            out << p1.x << GAP << p1.y << GAP << p1.z << endl;
-            out << p2.x << GAP << p2.y << GAP << p2.z << endl;
-            out << p3.x << GAP << p3.y << GAP << p3.z << endl;
-            out << endl;
 
-            count++; 
+int main(int argc, char **argv) {
+    Paths paths;
+    StatsFormat statsFormat = STATS_NONE;
+    bool floatDepth = false;
+    bool parallelViews = false;
+    bool stream = false;
+    bool cache = false;
+    string cacheDir;
+    size_t chunk = STREAM_CHUNK;
+    const char *convertIn = nullptr, *convertOut = nullptr;
+    RenderOptions opt;
+    bool zBufferNamed = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i+1 < argc;
+
+        if ((arg == "-i" || arg == "--scene") && hasValue) {
+            paths.scene = argv[++i];
         }
-        else if (s == "translate") {
-            Point p;
-            in >> p.x >> p.y >> p.z;
-
-            Matrix m;
-            m.translation(p);
-
-            Matrix t = st.top()*m;
-            st.pop();
-            st.push(t);
+        else if ((arg == "-g" || arg == "--config") && hasValue) {
+            paths.config = argv[++i];
         }
-        else if (s == "scale") {
-            Point p;
-            in >> p.x >> p.y >> p.z;
-
-            Matrix m;
-            m.scaling(p);
-            Matrix t = st.top()*m;
-            st.pop();
-            st.push(t);
+        else if ((arg == "-o" || arg == "--output") && hasValue) {
+            paths.image = argv[++i];
         }
-        else if (s == "rotate") {
-            double angle;
-            Point p;
-            in >> angle >> p.x >> p.y >> p.z;
-
-            Matrix m;
-            m.rotate(p, angle);
-            Matrix t = st.top()*m;
-            st.pop();
-            st.push(t);
+        else if ((arg == "-z" || arg == "--zbuffer") && hasValue) {
+            paths.zBuffer = argv[++i];
+            zBufferNamed = true;
+        }
+        else if (arg == "--zbuffer-format" && hasValue) {
+            string format = argv[++i];
+            if (format == "text") paths.zBufferFormat = DEPTH_TEXT;
+            else if (format == "raw") paths.zBufferFormat = DEPTH_RAW;
+            else if (format == "pfm") paths.zBufferFormat = DEPTH_PFM;
+            else if (format == "bmp") paths.zBufferFormat = DEPTH_BMP;
+            else {
+                cerr << "unknown z-buffer format " << format << endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-v" || arg == "--views") && hasValue) {
+            paths.views = argv[++i];
         }
-        else if (s == "push") {
-            st.push(st.top());
+        else if ((arg == "-e" || arg == "--edits") && hasValue) {
+            paths.edits = argv[++i];
         }
-        else if (s == "pop") {
-            if(!st.empty()) {
-                st.pop();
+        else if (arg == "--stream") {
+            stream = true;
+        }
+        else if (arg == "--bench" && hasValue) {
+            bench(strtoull(argv[++i], nullptr, 10));
+            return 0;
+        }
+        else if (arg == "--cache" && hasValue) {
+            cache = true;
+            cacheDir = argv[++i];
+        }
+        else if (arg == "--chunk" && hasValue) {
+            chunk = max(atoll(argv[++i]), 1LL);
+        }
+        else if (arg == "--parallel-views") {
+            parallelViews = true;
+        }
+        else if (arg == "-d" || arg == "--dump-stages") {
+            opt.dumpStages = true;
+        }
+        else if (arg == "--stage-prefix" && hasValue) {
+            opt.stagePrefix = argv[++i];
+        }
+        else if (arg == "-s" || arg == "--stats") {
+            if (statsFormat == STATS_NONE) statsFormat = STATS_TEXT;
+        }
+        else if (arg == "--stats-format" && hasValue) {
+            string format = argv[++i];
+            if (format == "text") statsFormat = STATS_TEXT;
+            else if (format == "json") statsFormat = STATS_JSON;
+            else {
+                cerr << "unknown stats format " << format << endl;
+                return 1;
             }
         }
-        else if (s == "end") {
-            break;
+        else if ((arg == "-t" || arg == "--threads") && hasValue) {
+            opt.threads = atoi(argv[++i]);
+        }
+        else if (arg == "--sort") {
+            opt.sortFrontToBack = true;
+        }
+        else if ((arg == "-m" || arg == "--msaa") && hasValue) {
+            opt.samples = atoi(argv[++i]);
+            if (opt.samples != 1 && opt.samples != 2 && opt.samples != 4 && opt.samples != 8) {
+                cerr << "unsupported sample count " << opt.samples << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--seed" && hasValue) {
+            opt.colorSeed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--depth" && hasValue) {
+            string type = argv[++i];
+            if (type == "float") floatDepth = true;
+            else if (type == "double") floatDepth = false;
+            else {
+                cerr << "unknown depth type " << type << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--stage-format" && hasValue) {
+            string format = argv[++i];
+            if (format == "text") opt.stageFormat = STAGE_TEXT;
+            else if (format == "binary") opt.stageFormat = STAGE_BINARY;
+            else if (format == "binary32") opt.stageFormat = STAGE_BINARY32;
+            else {
+                cerr << "unknown stage format " << format << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--convert" && i+2 < argc) {
+            convertIn = argv[++i];
+            convertOut = argv[++i];
+        }
+        else if ((arg == "-c" || arg == "--cull") && hasValue) {
+            string mode = argv[++i];
+            if (mode == "none") opt.cull = CULL_NONE;
+            else if (mode == "back") opt.cull = CULL_BACK;
+            else if (mode == "front") opt.cull = CULL_FRONT;
+            else {
+                cerr << "unknown cull mode " << mode << endl;
+                return 1;
+            }
+        }
+        else {
+            usage(argv[0]);
+            return 1;
         }
-
     }
 
-    in.close();
-    out.close();
-
-
-
-
-
-    in.open("stage1.txt");
-    out.open("stage2.txt");
-
-    Matrix mat2;
-    mat2.viewMatrix(cam, look, up);
-
-    for(int i = 0; i < count; i++) {
-        Point p1, p2, p3;
-        in >> p1.x >> p1.y >> p1.z;
-        in >> p2.x >> p2.y >> p2.z;
-        in >> p3.x >> p3.y >> p3.z;
-
-        p1 = mat2*p1;
-        p2 = mat2*p2;
-        p3 = mat2*p3;
-
-        out << setprecision(6) << fixed;
-        out << p1.x << GAP << p1.y << GAP << p1.z << endl;
-        out << p2.x << GAP << p2.y << GAP << p2.z << endl;
-        out << p3.x << GAP << p3.y << GAP << p3.z << endl;
-        out << endl;
+    if (!zBufferNamed) {
+        const char *extension[] = {".txt", ".raw", ".pfm", ".bmp"};
+        paths.zBuffer = string("z_buffer") + extension[paths.zBufferFormat];
     }
 
-    in.close();
-    out.close();
-
-
-
-
-
-    in.open("stage2.txt");
-    out.open("stage3.txt");
-
-    Matrix mat3;
-    mat3.projectionMatrix(fovY, aspect, near, far);
-
-    for (int i = 0; i < count; i++) {
-        Point p1, p2, p3;
-        in >> p1.x >> p1.y >> p1.z;
-        in >> p2.x >> p2.y >> p2.z;
-        in >> p3.x >> p3.y >> p3.z;
-
-        p1 = mat3*p1;
-        p2 = mat3*p2;
-        p3 = mat3*p3;
-
-        out << setprecision(6) << fixed;
-        out << p1.x << GAP << p1.y << GAP << p1.z << endl;
-        out << p2.x << GAP << p2.y << GAP << p2.z << endl;
-        out << p3.x << GAP << p3.y << GAP << p3.z << endl;
-        out << endl;
+    if (convertIn) {
+        if (!convertStage(convertIn, convertOut, opt.stageFormat)) {
+            cerr << "cannot convert " << convertIn << endl;
+            return 1;
+        }
+        return 0;
     }
 
-    in.close();
-    out.close();
-
-
-
-
-
-    in.open("config.txt");
-
-    int screenWidth = 100, screenHeight = 100;
-    in >> screenWidth >> screenHeight;
-
-    in.close();
-
-
-    in.open("stage3.txt");
-    out.open("z_buffer.txt");
+    if (stream && (!paths.views.empty() || opt.dumpStages || cache || !paths.edits.empty())) {
+        cerr << "--stream cannot be combined with -v, -d, --cache or -e" << endl;
+        return 1;
+    }
 
-    double dx = 2.0/screenWidth;
-    double dy = 2.0/screenHeight;
+    // the retained frame is single sample and in scene order, and edits
+    // need the scene's top-level commands, which a program no longer has
+    if (!paths.edits.empty() && (opt.samples > 1 || opt.sortFrontToBack || !paths.views.empty() || cache || opt.dumpStages)) {
+        cerr << "-e cannot be combined with -m, --sort, -v, --cache or -d" << endl;
+        return 1;
+    }
 
-    double topY = 1-dy/2;
-    double bottomY = -1+dy/2;
-    double leftX = -1+dx/2;
-    double rightX = 1-dx/2;
+    RenderStats parse;
 
-    vector<vector<double>> z_buffer(screenHeight, vector<double>(screenWidth, 1.0));
-    
+    if (stream) {
+        Config config;
+        {
+            STAT_TIME(parse, STAT_PARSE);
+            loadConfig(paths.config.c_str(), config);
+        }
 
-    bitmap_image image(screenWidth, screenHeight);
-    for (int i = 0; i < screenWidth; i++) {
-        for (int j = 0; j < screenHeight; j++) {
-            image.set_pixel(i, j, 0, 0, 0);
+        bool ok = floatDepth ? runStream<float>(config, opt, paths, chunk, parse, statsFormat)
+                             : runStream<double>(config, opt, paths, chunk, parse, statsFormat);
+        if (!ok) {
+            cerr << "cannot read scene " << paths.scene << endl;
+            return 1;
         }
+        return 0;
     }
 
-    for(int t = 0; t < count; t++) {
-        Point p1, p2, p3;
-        in >> p1.x >> p1.y >> p1.z;
-        in >> p2.x >> p2.y >> p2.z;
-        in >> p3.x >> p3.y >> p3.z;
-
-        Triangle tr(p1, p2, p3);
-
-        double minX, maxX, minY, maxY;
-
-        minX = min(min(p1.x, p2.x), p3.x);
-        maxX = max(max(p1.x, p2.x), p3.x);
-        minY = min(min(p1.y, p2.y), p3.y);
-        maxY = max(max(p1.y, p2.y), p3.y);
-
-        minX = max(minX, leftX);
-        maxX = min(maxX, rightX);
-        minY = max(minY,bottomY);
-        maxY = min(maxY,topY);
-
-        int startY = round((topY-minY)/dy);
-        int endY = round((topY-maxY)/dy);
-
-        for(int i = endY; i <= startY; i++) {
-            double y = topY - i*dy;
-
-            vector<double> xx(2), zz(2);
-            int cnt = 0;
-
-            for(int k = 0; k < 3; k++) {
-                int l = (k+1)%3;
-
-                if(tr.points[k].y == tr.points[l].y) continue;
-
-                if(y >= min(tr.points[k].y, tr.points[l].y) && y <= max(tr.points[k].y, tr.points[l].y)) {
-                    xx[cnt] = tr.points[k].x - (tr.points[k].x - tr.points[l].x)*(tr.points[k].y - y)/(tr.points[k].y - tr.points[l].y);
-                    zz[cnt] = tr.points[k].z - (tr.points[k].z - tr.points[l].z)*(tr.points[k].y - y)/(tr.points[k].y - tr.points[l].y);
-                    cnt++;
-                }
-            }
-
-            vector<double> tempx(2);
-            tempx = xx;
-
-            for(int k = 0; k < 2; k++) {
-                if(xx[k] < minX) xx[k] = minX;
-                if(xx[k] > maxX) xx[k] = maxX;
-            }
-
-            zz[0] = zz[1] - (zz[1] - zz[0])*(tempx[1] - xx[0])/(tempx[1] - tempx[0]);
-            zz[1] = zz[1] - (zz[1] - zz[0])*(tempx[1] - xx[1])/(tempx[1] - tempx[0]);
-
-            double xa, za, xb, zb;
-            xa = xx[0];
-            xb = xx[1];
-            za = zz[0];
-            zb = zz[1];
-
-            if(xx[0] >= xx[1]) {
-                swap(xa, xb);
-                swap(za, zb);
-                swap(tempx[0], tempx[1]);
-            }
-
-            int startX = round((xa-leftX)/dx);
-            int endX = round((xb-leftX)/dx);
-            
-            for(int j = startX; j <= endX; j++) {
-                double xp = leftX + j*dx;
-
-                double zp = zb - (zb-za)*((xb-xp)/(xb-xa));
-
-                if (zp < -1) continue;
-                if (zp < z_buffer[j][i]) {
-                    z_buffer[j][i] = zp;
-                    image.set_pixel(j, i, tr.col[0], tr.col[1], tr.col[2]);
-                }
+    if (cache) {
+        SceneProgram prog;
+        bool hit = false;
+        {
+            STAT_TIME(parse, STAT_PARSE);
+            if (!loadSceneProgram(paths.scene.c_str(), cacheDir, prog, hit)) {
+                cerr << "cannot read scene " << paths.scene << endl;
+                return 1;
             }
         }
+        if (statsFormat == STATS_TEXT) cout << "scene cache " << (hit ? "hit" : "miss") << '\n';
+        return runScene(prog, paths, opt, floatDepth, parallelViews, parse, statsFormat);
     }
 
-    for (int i = 0; i < screenHeight; i++) {
-        for (int j = 0; j < screenWidth; j++) {
-            if (z_buffer[i][j] < 1.0) {
-                out << setprecision(6) << fixed;
-                out << z_buffer[i][j] << "\t";
-            }
+    Scene scene;
+    {
+        STAT_TIME(parse, STAT_PARSE);
+        if (!loadScene(paths.scene.c_str(), scene)) {
+            cerr << "cannot read scene " << paths.scene << endl;
+            return 1;
         }
-        out << endl;
     }
 
-    in.close();
-    out.close();
-    image.save_image("out.bmp");
-
-    z_buffer.clear();
-    image.clear();
+    if (!paths.edits.empty()) {
+        vector<Edit> edits;
+        Config config;
+        {
+            STAT_TIME(parse, STAT_PARSE);
+            if (!loadEdits(paths.edits.c_str(), edits)) {
+                cerr << "cannot read edits " << paths.edits << endl;
+                return 1;
+            }
+            loadConfig(paths.config.c_str(), config);
+        }
 
-    return 0;
+        bool ok = floatDepth ? runEdits<float>(scene, config, edits, opt, paths, parse, statsFormat)
+                             : runEdits<double>(scene, config, edits, opt, paths, parse, statsFormat);
+        return ok ? 0 : 1;
+    }
+    return runScene(scene, paths, opt, floatDepth, parallelViews, parse, statsFormat);
 }
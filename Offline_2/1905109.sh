@@ -1,4 +1,4 @@
-g++ 1905109.cpp -o demo -lglut -lGLU -lGL
+g++ -O2 -march=native -ffp-contract=off -pthread 1905109.cpp -o demo -lglut -lGLU -lGL
 
 ./demo
 
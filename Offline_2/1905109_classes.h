@@ -0,0 +1,398 @@
+#ifndef CLASSES_1905109_H
+#define CLASSES_1905109_H
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <stack>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+#include <cstdint>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+
+namespace offline2 {
+
+using namespace std;
+
+constexpr double pi = 3.14159265358979323846;
+constexpr long dim = 4;
+constexpr char GAP = ' ';
+
+
+// splitmix64 finalizer
+inline uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// One channel of the color of the index-th triangle of a scene. It is a pure
+// function of (seed, index, channel), so triangles can be colored in any
+// order or in parallel. It keeps the 15 bit draw and %255+1 mapping of the
+// old LCG, so the palette is distributed the same way.
+inline int triangleColor(uint64_t seed, uint64_t index, int channel) {
+    uint64_t h = mix64(mix64(seed) ^ (index*3 + channel));
+    return ((h >> 16) & 0x7FFF)%255+1;
+}
+
+
+struct Point {
+    double x, y, z, n;
+
+    Point() {
+        x = y = z = 0;
+        n = 1;
+    }
+    Point(double x, double y, double z) {
+        this->x = x;
+        this->y = y;
+        this->z = z;
+        this->n = 1;
+    }
+    Point(double x, double y, double z, double n) {
+        this->x = x;
+        this->y = y;
+        this->z = z;
+        this->n = n;
+    }
+    Point(const Point &p) {
+        this->x = p.x;
+        this->y = p.y;
+        this->z = p.z;
+        this->n = p.n;
+    }
+
+    Point operator +(Point p) {
+        return Point(x+p.x, y+p.y, z+p.z);
+    }
+    Point operator -(Point p) {
+        return Point(x-p.x, y-p.y, z-p.z);
+    }
+    Point operator *(double c) {
+        return Point(x*c, y*c, z*c);
+    }
+    Point operator /(double c) {
+        return Point(x/c, y/c, z/c);
+    }
+    Point operator ^(Point p) {
+        return Point(y*p.z - z*p.y, z*p.x - x*p.z, x*p.y - y*p.x);
+    }
+    double operator *(Point p) {
+        return (x*p.x + y*p.y + z*p.z);
+    }
+
+    double length() {
+        return sqrt(x*x + y*y + z*z);
+    }
+
+    void normalize() {
+        double len = length();
+        x /= len;
+        y /= len;
+        z /= len;
+    }
+
+    void scale() {
+        x /= n;
+        y /= n;
+        z /= n;
+        n = 1;
+    }
+
+    
+    void setPoint(Point &p) {
+        this->x = p.x;
+        this->y = p.y;
+        this->z = p.z;
+        this->n = p.n;
+    }
+    void setPoint(double x, double y, double z) {
+        this->x = x;
+        this->y = y;
+        this->z = z;
+        this->n = 1;
+    }
+    void setPoint(double x, double y, double z, double n) {
+        this->x = x;
+        this->y = y;
+        this->z = z;
+        this->n = n;
+    }
+
+};
+
+// Points stored one array per coordinate, so a batch of them can be
+// transformed four at a time.
+struct PointArray {
+    vector<double> x, y, z, n;
+
+    size_t size() const {
+        return x.size();
+    }
+
+    void resize(size_t size) {
+        x.resize(size);
+        y.resize(size);
+        z.resize(size);
+        n.resize(size, 1);
+    }
+
+    void reserve(size_t size) {
+        x.reserve(size);
+        y.reserve(size);
+        z.reserve(size);
+        n.reserve(size);
+    }
+
+    void clear() {
+        x.clear();
+        y.clear();
+        z.clear();
+        n.clear();
+    }
+
+    void push_back(const Point &p) {
+        x.push_back(p.x);
+        y.push_back(p.y);
+        z.push_back(p.z);
+        n.push_back(p.n);
+    }
+
+    Point operator[](size_t i) const {
+        return Point(x[i], y[i], z[i], n[i]);
+    }
+};
+
+struct Triangle{
+    Point points[3];
+    int col[3];
+
+    Triangle() {
+        setColor(1, 0);
+    }
+
+    Triangle(Point p, Point q, Point r, uint64_t seed, uint64_t index) {
+        points[0] = p;
+        points[1] = q;
+        points[2] = r;
+        setColor(seed, index);
+    }
+
+    void setColor(uint64_t seed, uint64_t index) {
+        col[0] = triangleColor(seed, index, 0);
+        col[1] = triangleColor(seed, index, 1);
+        col[2] = triangleColor(seed, index, 2);
+    }
+
+    void setPoints(Point p, Point q, Point r) {
+        points[0] = p;
+        points[1] = q;
+        points[2] = r;
+    }
+
+    void project() {
+        points[0].scale();
+        points[1].scale();
+        points[2].scale();
+    }
+};
+
+
+struct Matrix{
+    double mat[dim][dim];
+
+    Matrix() {
+        for (int i = 0; i < dim; i++) {
+            for (int j = 0; j < dim; j++) {
+                mat[i][j] = 0;
+            }
+        }
+    }
+
+    // Every sum below is written out in k order, the order the old loops
+    // added in. The SIMD paths use separate multiplies and adds, and
+    // 1905109.sh builds with -ffp-contract=off so the scalar ones are not
+    // fused into FMAs either; both paths then give the same bits.
+    Matrix operator*(const Matrix &p) const {
+        Matrix ret;
+        for (int i = 0; i < dim; i++) {
+#ifdef __AVX2__
+            __m256d r = _mm256_mul_pd(_mm256_set1_pd(mat[i][0]), _mm256_loadu_pd(p.mat[0]));
+            r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(mat[i][1]), _mm256_loadu_pd(p.mat[1])));
+            r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(mat[i][2]), _mm256_loadu_pd(p.mat[2])));
+            r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_set1_pd(mat[i][3]), _mm256_loadu_pd(p.mat[3])));
+            _mm256_storeu_pd(ret.mat[i], r);
+#else
+            for (int j = 0; j < dim; j++) {
+                ret.mat[i][j] = mat[i][0]*p.mat[0][j] + mat[i][1]*p.mat[1][j] + mat[i][2]*p.mat[2][j] + mat[i][3]*p.mat[3][j];
+            }
+#endif
+        }
+        return ret;
+    }
+
+    Point operator*(const Point &p) const {
+        Point ret = transform(p);
+        ret.scale();
+        return ret;
+    }
+
+    // homogeneous product, without the divide by n
+    Point transform(const Point &p) const {
+        return Point(row(0, p.x, p.y, p.z, p.n), row(1, p.x, p.y, p.z, p.n),
+                     row(2, p.x, p.y, p.z, p.n), row(3, p.x, p.y, p.z, p.n));
+    }
+
+    double row(int i, double x, double y, double z, double n) const {
+        return mat[i][0]*x + mat[i][1]*y + mat[i][2]*z + mat[i][3]*n;
+    }
+
+#ifdef __AVX2__
+    static __m256d row(__m256d *m, __m256d x, __m256d y, __m256d z, __m256d n) {
+        __m256d r = _mm256_mul_pd(m[0], x);
+        r = _mm256_add_pd(r, _mm256_mul_pd(m[1], y));
+        r = _mm256_add_pd(r, _mm256_mul_pd(m[2], z));
+        return _mm256_add_pd(r, _mm256_mul_pd(m[3], n));
+    }
+#endif
+
+    // Homogeneous product of points first .. first+count-1 of in, written
+    // to out[0 .. count-1]. With AVX2 four points go through at once.
+    void transform(const PointArray &in, size_t first, size_t count, PointArray &out) const {
+        out.resize(count);
+        const double *x = in.x.data()+first, *y = in.y.data()+first, *z = in.z.data()+first, *n = in.n.data()+first;
+        double *ox = out.x.data(), *oy = out.y.data(), *oz = out.z.data(), *on = out.n.data();
+
+        size_t v = 0;
+#ifdef __AVX2__
+        __m256d m[dim][dim];
+        for (int i = 0; i < dim; i++) {
+            for (int j = 0; j < dim; j++) {
+                m[i][j] = _mm256_set1_pd(mat[i][j]);
+            }
+        }
+        for (; v+4 <= count; v += 4) {
+            __m256d px = _mm256_loadu_pd(x+v), py = _mm256_loadu_pd(y+v);
+            __m256d pz = _mm256_loadu_pd(z+v), pn = _mm256_loadu_pd(n+v);
+            _mm256_storeu_pd(ox+v, row(m[0], px, py, pz, pn));
+            _mm256_storeu_pd(oy+v, row(m[1], px, py, pz, pn));
+            _mm256_storeu_pd(oz+v, row(m[2], px, py, pz, pn));
+            _mm256_storeu_pd(on+v, row(m[3], px, py, pz, pn));
+        }
+#endif
+        for (; v < count; v++) {
+            double px = x[v], py = y[v], pz = z[v], pn = n[v];
+            ox[v] = row(0, px, py, pz, pn);
+            oy[v] = row(1, px, py, pz, pn);
+            oz[v] = row(2, px, py, pz, pn);
+            on[v] = row(3, px, py, pz, pn);
+        }
+    }
+
+    void identity() {
+        for (int i = 0; i < dim; i++) {
+            for (int j = 0; j < dim; j++) {
+                if (i == j) {
+                    mat[i][j] = 1;
+                    continue;
+                }
+                mat[i][j] = 0;
+            }
+        }
+    }
+
+    void translation(Point p) {
+        identity();
+        mat[0][3] = p.x;
+        mat[1][3] = p.y;
+        mat[2][3] = p.z;
+    }
+
+    void scaling(Point p) {
+        identity();
+        mat[0][0] = p.x;
+        mat[1][1] = p.y;
+        mat[2][2] = p.z;
+    }
+
+    Point rodrigues(Point p, Point axis, double angle) {
+        double theta = angle*pi/180;
+        return p*cos(theta) + axis*(axis*p)*(1-cos(theta)) + (axis^p)*sin(theta);   
+    }
+
+    void rotate(Point axis, double angle) {
+        identity();
+        Point a = axis;
+        a.normalize();
+        
+        Point x(1, 0, 0), y(0, 1, 0), z(0, 0, 1);
+        x = rodrigues(x, a, angle);
+        y = rodrigues(y, a, angle);
+        z = rodrigues(z, a, angle);
+
+        mat[0][0] = x.x;
+        mat[1][0] = x.y;
+        mat[2][0] = x.z;
+        mat[0][1] = y.x;
+        mat[1][1] = y.y;
+        mat[2][1] = y.z;
+        mat[0][2] = z.x;
+        mat[1][2] = z.y;
+        mat[2][2] = z.z;
+    }
+
+
+    void viewMatrix(Point cam, Point look, Point up) {
+        identity();
+        Point z = look-cam; z.normalize();
+        Point x = z^up; x.normalize();
+        Point y = x^z; y.normalize(); 
+
+        mat[0][0] = x.x;
+        mat[0][1] = x.y;
+        mat[0][2] = x.z;
+        mat[1][0] = y.x;
+        mat[1][1] = y.y;
+        mat[1][2] = y.z;
+        mat[2][0] = -z.x;
+        mat[2][1] = -z.y;
+        mat[2][2] = -z.z;
+
+        Matrix m;
+        m.translation(Point(-cam.x, -cam.y, -cam.z));
+
+        m = m*(*this);
+        *this = m;
+    }
+
+    void projectionMatrix(double fovY, double aspect, double near, double far) {
+        identity();
+        double fovX = fovY*aspect;
+        double angleR = (fovX/2)*pi/180;
+        double r = near*tan(angleR);
+        double angleT = (fovY/2)*pi/180;
+        double t = near*tan(angleT);
+
+        mat[0][0] = near/r;
+        mat[1][1] = near/t;
+        mat[2][2] = -(far+near)/(far-near);
+        mat[3][2] = -1;
+        mat[2][3] = -2*far*near/(far-near);
+        mat[3][3] = 0;
+    }
+
+    
+};
+
+
+} // namespace offline2
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef PROGRAM_1905109_H
+#define PROGRAM_1905109_H
+
+#include <cstdio>
+#include <thread>
+#include <functional>
+#include "1905109_classes.h"
+#include "1905109_scene.h"
+
+#ifdef _WIN32
+#include <process.h>
+#endif
+
+
+namespace offline2 {
+
+// A scene compiled to a flat draw list. Push, pop, the transforms,
+// instances and repeats are all resolved at compile time: every op draws
+// with one of the prebuilt model matrices, so running a program is a
+// single pass over ops with no stack and no strings.
+//
+//   OP_TRIANGLES  triangles first .. first+count-1 of vertices (3 each)
+//   OP_MESH       meshes[first]
+//
+// Geometry is stored once; an instanced block adds ops and matrices, not
+// vertices.
+enum ProgramOpCode { OP_TRIANGLES, OP_MESH };
+
+struct ProgramOp {
+    uint32_t code;
+    uint32_t matrix;
+    uint32_t first, count;
+};
+
+struct SceneProgram {
+    Camera camera;
+    vector<Matrix> matrices;
+    vector<ProgramOp> ops;
+    PointArray vertices;
+    vector<Mesh> meshes;
+    // obj files the scene read, with the FNV-1a hash of their contents
+    vector<string> sources;
+    vector<uint64_t> sourceHashes;
+};
+
+
+inline uint64_t fnv1a(const char *data, size_t size, uint64_t h = 0xcbf29ce484222325ULL) {
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+inline bool hashFile(const char *fileName, uint64_t &h) {
+    MappedFile file;
+    if (!file.open(fileName)) return false;
+    h = fnv1a(file.data, file.size);
+    return true;
+}
+
+
+// Walks the scene the way ModelingState does, but records the matrix in
+// effect at each draw instead of transforming anything. A matrix is added
+// to the table only when something is drawn with it, and the stack keeps
+// each level's table index, so a pop goes back to an existing entry.
+struct ProgramCompiler {
+    Scene &scene;
+    SceneProgram &prog;
+    stack<pair<Matrix, int>> st;
+    // first triangle slot of the top level (0) and of each block (b+1)
+    vector<uint32_t> slotBase;
+
+    ProgramCompiler(Scene &scene, SceneProgram &prog) : scene(scene), prog(prog) {
+        Matrix mat1;
+        mat1.identity();
+        st.push(make_pair(mat1, -1));
+    }
+
+    void layout(vector<SceneCommand> &commands) {
+        slotBase.push_back(prog.vertices.size()/3);
+        for (SceneCommand &c : commands) {
+            if (c.type != CMD_TRIANGLE) continue;
+            prog.vertices.push_back(c.p[0]);
+            prog.vertices.push_back(c.p[1]);
+            prog.vertices.push_back(c.p[2]);
+        }
+    }
+
+    uint32_t matrix() {
+        if (st.top().second < 0) {
+            st.top().second = prog.matrices.size();
+            prog.matrices.push_back(st.top().first);
+        }
+        return st.top().second;
+    }
+
+    void draw(uint32_t code, uint32_t first) {
+        uint32_t m = matrix();
+        if (code == OP_TRIANGLES && !prog.ops.empty()) {
+            ProgramOp &last = prog.ops.back();
+            if (last.code == OP_TRIANGLES && last.matrix == m && last.first+last.count == first) {
+                last.count++;
+                return;
+            }
+        }
+        prog.ops.push_back({code, m, first, 1});
+    }
+
+    void walk(vector<SceneCommand> &commands, int list) {
+        uint32_t slot = slotBase[list];
+        for (SceneCommand &c : commands) {
+            if (c.type == CMD_TRIANGLE) {
+                draw(OP_TRIANGLES, slot++);
+            }
+            else if (c.type == CMD_MESH) {
+                draw(OP_MESH, c.index);
+            }
+            else if (c.type == CMD_INSTANCE || c.type == CMD_REPEAT) {
+                int passes = c.type == CMD_INSTANCE ? 1 : c.count;
+                st.push(st.top());
+                for (int k = 0; k < passes; k++) {
+                    walk(scene.blocks[c.index], c.index+1);
+                }
+                if (st.size() > 1) st.pop();
+            }
+            else if (c.type == CMD_PUSH) {
+                st.push(st.top());
+            }
+            else if (c.type == CMD_POP) {
+                if (st.size() > 1) st.pop();
+            }
+            else {
+                Matrix t = st.top().first*commandMatrix(c);
+                st.pop();
+                st.push(make_pair(t, -1));
+            }
+        }
+    }
+};
+
+
+// false if an obj file the scene read can no longer be hashed
+inline bool compileScene(Scene &scene, SceneProgram &prog) {
+    prog = SceneProgram();
+    prog.camera = scene.camera;
+
+    ProgramCompiler compiler(scene, prog);
+    compiler.layout(scene.commands);
+    for (vector<SceneCommand> &block : scene.blocks) {
+        compiler.layout(block);
+    }
+    compiler.walk(scene.commands, 0);
+
+    prog.meshes = scene.meshes;
+    prog.sources = scene.sources;
+    for (string &source : prog.sources) {
+        uint64_t h;
+        if (!hashFile(source.c_str(), h)) return false;
+        prog.sourceHashes.push_back(h);
+    }
+    return true;
+}
+
+
+// Runs a program: the vertices of an op go through base*matrix in one
+// batched transform, and triangles are colored by their position in the
+// draw order, exactly as modelingStage would. Returns the number of
+// vertices transformed.
+inline long long runProgram(SceneProgram &prog, Matrix &base, vector<Triangle> &triangles, uint64_t seed) {
+    vector<Matrix> mvp(prog.matrices.size());
+    for (size_t m = 0; m < prog.matrices.size(); m++) {
+        mvp[m] = base*prog.matrices[m];
+    }
+
+    uint64_t index = 0;
+    long long vertices = 0;
+    PointArray cache;
+    for (ProgramOp &op : prog.ops) {
+        Matrix &m = mvp[op.matrix];
+        if (op.code == OP_TRIANGLES) {
+            m.transform(prog.vertices, (size_t)op.first*3, (size_t)op.count*3, cache);
+            for (size_t v = 0; v < cache.size(); v += 3) {
+                triangles.push_back(Triangle(cache[v], cache[v+1], cache[v+2], seed, index++));
+            }
+            vertices += op.count*3;
+        }
+        else {
+            Mesh &mesh = prog.meshes[op.first];
+            m.transform(mesh.vertices, 0, mesh.vertices.size(), cache);
+            for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+                int *i = &mesh.indices[t];
+                triangles.push_back(Triangle(cache[i[0]], cache[i[1]], cache[i[2]], seed, index++));
+            }
+            vertices += mesh.vertices.size();
+        }
+    }
+    return vertices;
+}
+
+
+// On-disk program: this header, then the matrices, the ops, the vertices
+// (x y z doubles), every mesh as a vertex and an index count followed by
+// its data, and every source as a length, its path and its hash. Native
+// byte order; a version or layout change makes old files misses.
+struct ProgramHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sceneHash;
+    double camera[13];
+    uint64_t matrices, ops, vertices, meshes, sources;
+};
+
+const char programMagic[4] = {'S', 'C', 'B', 'C'};
+
+
+inline void putPoints(string &out, PointArray &points) {
+    for (size_t i = 0; i < points.size(); i++) {
+        double c[3] = {points.x[i], points.y[i], points.z[i]};
+        out.append((const char*)c, sizeof(c));
+    }
+}
+
+inline void cameraArray(Camera &cam, double a[13]) {
+    double v[13] = {cam.eye.x, cam.eye.y, cam.eye.z, cam.look.x, cam.look.y, cam.look.z,
+                    cam.up.x, cam.up.y, cam.up.z, cam.fovY, cam.aspect, cam.near, cam.far};
+    copy(v, v+13, a);
+}
+
+
+// fileName with the process and thread appended, so concurrent writers of
+// the same cache file never share a temporary
+inline string tempName(const string &fileName) {
+    string tmp = fileName + ".";
+#ifdef SCENE_MMAP
+    tmp += to_string(getpid()) + ".";
+#elif defined(_WIN32)
+    tmp += to_string(_getpid()) + ".";
+#endif
+    return tmp + to_string(hash<thread::id>()(this_thread::get_id())) + ".tmp";
+}
+
+// Written to a temporary name and renamed into place, so a reader never
+// sees half a file.
+inline bool saveProgram(const string &fileName, SceneProgram &prog, uint64_t sceneHash) {
+    ProgramHeader h;
+    memcpy(h.magic, programMagic, 4);
+    h.version = 1;
+    h.sceneHash = sceneHash;
+    cameraArray(prog.camera, h.camera);
+    h.matrices = prog.matrices.size();
+    h.ops = prog.ops.size();
+    h.vertices = prog.vertices.size();
+    h.meshes = prog.meshes.size();
+    h.sources = prog.sources.size();
+
+    string out((const char*)&h, sizeof(h));
+    out.append((const char*)prog.matrices.data(), prog.matrices.size()*sizeof(Matrix));
+    out.append((const char*)prog.ops.data(), prog.ops.size()*sizeof(ProgramOp));
+    putPoints(out, prog.vertices);
+    for (Mesh &m : prog.meshes) {
+        uint64_t n[2] = {m.vertices.size(), m.indices.size()};
+        out.append((const char*)n, sizeof(n));
+        putPoints(out, m.vertices);
+        out.append((const char*)m.indices.data(), m.indices.size()*sizeof(int));
+    }
+    for (size_t s = 0; s < prog.sources.size(); s++) {
+        uint64_t n[2] = {prog.sources[s].size(), prog.sourceHashes[s]};
+        out.append((const char*)n, sizeof(n));
+        out.append(prog.sources[s]);
+    }
+
+    string tmp = tempName(fileName);
+    ofstream file(tmp, ios::binary);
+    file.write(out.data(), out.size());
+    file.close();
+    if (!file || rename(tmp.c_str(), fileName.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Bounds checked reads from a mapped program file.
+struct ProgramReader {
+    const char *cur, *end;
+    bool ok;
+
+    bool get(void *dst, size_t size) {
+        ok = ok && (size_t)(end-cur) >= size;
+        if (ok) {
+            memcpy(dst, cur, size);
+            cur += size;
+        }
+        return ok;
+    }
+
+    bool getPoints(PointArray &points, uint64_t n) {
+        if (!ok || (size_t)(end-cur)/(3*sizeof(double)) < n) return ok = false;
+        points.clear();
+        points.resize(n);
+        for (uint64_t i = 0; i < n; i++) {
+            double c[3];
+            get(c, sizeof(c));
+            points.x[i] = c[0];
+            points.y[i] = c[1];
+            points.z[i] = c[2];
+        }
+        return ok;
+    }
+};
+
+
+// false when the file is missing, was made from other scene text or an
+// older layout, or an obj file it was compiled from has changed
+inline bool loadProgram(const string &fileName, SceneProgram &prog, uint64_t sceneHash) {
+    MappedFile file;
+    if (!file.open(fileName.c_str())) return false;
+
+    ProgramReader in = {file.data, file.data + file.size, true};
+    ProgramHeader h;
+    if (!in.get(&h, sizeof(h)) || memcmp(h.magic, programMagic, 4) != 0) return false;
+    if (h.version != 1 || h.sceneHash != sceneHash) return false;
+
+    // a count can not exceed the bytes left
+    size_t left = file.size;
+    if (h.matrices > left/sizeof(Matrix) || h.ops > left/sizeof(ProgramOp) || h.meshes > left || h.sources > left) return false;
+
+    prog = SceneProgram();
+    Camera &cam = prog.camera;
+    cam.eye = Point(h.camera[0], h.camera[1], h.camera[2]);
+    cam.look = Point(h.camera[3], h.camera[4], h.camera[5]);
+    cam.up = Point(h.camera[6], h.camera[7], h.camera[8]);
+    cam.fovY = h.camera[9];
+    cam.aspect = h.camera[10];
+    cam.near = h.camera[11];
+    cam.far = h.camera[12];
+
+    prog.matrices.resize(h.matrices);
+    prog.ops.resize(h.ops);
+    in.get(prog.matrices.data(), h.matrices*sizeof(Matrix));
+    in.get(prog.ops.data(), h.ops*sizeof(ProgramOp));
+    in.getPoints(prog.vertices, h.vertices);
+
+    prog.meshes.resize(h.meshes);
+    for (Mesh &m : prog.meshes) {
+        uint64_t n[2];
+        if (!in.get(n, sizeof(n)) || n[1] > left/sizeof(int)) return false;
+        in.getPoints(m.vertices, n[0]);
+        m.indices.resize(n[1]);
+        in.get(m.indices.data(), n[1]*sizeof(int));
+    }
+
+    for (uint64_t s = 0; s < h.sources; s++) {
+        uint64_t n[2], now;
+        if (!in.get(n, sizeof(n)) || n[0] > left) return false;
+        string source(n[0], ' ');
+        if (!in.get(&source[0], n[0])) return false;
+        if (!hashFile(source.c_str(), now) || now != n[1]) return false;
+        prog.sources.push_back(source);
+        prog.sourceHashes.push_back(n[1]);
+    }
+    if (!in.ok) return false;
+
+    // every reference must land inside the tables
+    for (ProgramOp &op : prog.ops) {
+        if (op.matrix >= prog.matrices.size()) return false;
+        if (op.code == OP_TRIANGLES && ((uint64_t)op.first+op.count)*3 > prog.vertices.size()) return false;
+        if (op.code == OP_MESH && op.first >= prog.meshes.size()) return false;
+        if (op.code != OP_TRIANGLES && op.code != OP_MESH) return false;
+    }
+    for (Mesh &m : prog.meshes) {
+        for (int i : m.indices) {
+            if (i < 0 || (size_t)i >= m.vertices.size()) return false;
+        }
+    }
+    return true;
+}
+
+
+// Loads the compiled form of a scene file from cacheDir, or parses,
+// compiles and stores it there. The cache file is named after the FNV-1a
+// hash of the scene text and the scene's directory, since relative obj
+// paths depend on it. hit tells which way it went.
+inline bool loadSceneProgram(const char *fileName, const string &cacheDir, SceneProgram &prog, bool &hit) {
+    MappedFile file;
+    if (!file.open(fileName)) return false;
+    string dir = directoryOf(fileName);
+    uint64_t h = fnv1a(dir.data(), dir.size(), fnv1a(file.data, file.size));
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.scb", (unsigned long long)h);
+    string path = cacheDir.empty() ? string(name) : cacheDir + "/" + name;
+
+    hit = loadProgram(path, prog, h);
+    if (hit) return true;
+
+    Scene scene;
+    if (!parseScene(file.data, file.size, scene, dir) || !compileScene(scene, prog)) return false;
+    // a cache that can not be written only costs the next run a compile
+    saveProgram(path, prog, h);
+    return true;
+}
+
+
+} // namespace offline2
+
+#endif
@@ -0,0 +1,1818 @@
+#ifndef RENDERER_1905109_H
+#define RENDERER_1905109_H
+
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <new>
+#include <chrono>
+#include "bitmap.hpp"
+#include "1905109_classes.h"
+#include "1905109_scene.h"
+#include "1905109_program.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+
+namespace offline2 {
+
+inline void transformStage(vector<Triangle> &triangles, Matrix &m) {
+    for (Triangle &tr : triangles) {
+        tr.setPoints(m.transform(tr.points[0]), m.transform(tr.points[1]), m.transform(tr.points[2]));
+    }
+}
+
+
+enum CullMode { CULL_NONE, CULL_BACK, CULL_FRONT };
+
+struct RenderOptions {
+    int threads;
+    CullMode cull;
+    bool dumpStages;
+    StageFormat stageFormat;
+    string stagePrefix;
+    uint64_t colorSeed;
+    bool sortFrontToBack;
+    // depth samples per pixel, 1 (off), 2, 4 or 8
+    int samples;
+
+    RenderOptions() {
+        threads = max((int)thread::hardware_concurrency(), 1);
+        cull = CULL_NONE;
+        dumpStages = false;
+        stageFormat = STAGE_TEXT;
+        colorSeed = 1;
+        sortFrontToBack = false;
+        samples = 1;
+    }
+};
+
+
+// Statistics cost a counter update per fragment and a clock read per stage;
+// build with -DRENDER_STATS=0 to compile all of it away.
+#ifndef RENDER_STATS
+#define RENDER_STATS 1
+#endif
+
+enum StatStage { STAT_PARSE, STAT_MODELING, STAT_VIEW, STAT_PROJECTION, STAT_CLIPPING, STAT_RASTER, STAT_RESOLVE, STAT_OUTPUT, STAT_STAGES };
+
+const char *const statStageNames[STAT_STAGES] = {"parse", "modeling", "view", "projection", "clipping", "rasterization", "resolve", "output"};
+
+
+struct RenderStats {
+    double seconds[STAT_STAGES];
+    // view and projection were folded into the transform of an earlier stage
+    bool fusedTransform;
+    long long verticesTransformed;
+    long long trianglesIn, trianglesOut;
+    long long trianglesAccepted, trianglesClipped, trianglesRejected, trianglesCulled;
+    long long fragmentsTested, fragmentsPassed;
+    long long hizTilesTested, hizTilesCulled, hizPixelsCulled;
+    long long blocksFull, blocksPartial, blocksEmpty;
+    long long pixels, pixelsCovered;
+    // depth writes of the same frame without the front to back sort, when measured
+    long long unsortedFragmentsPassed;
+    // framebuffer memory, and with MSAA the cost of the same frame at 1x
+    int samples;
+    long long frameBytes, baselineFrameBytes;
+    double baselineSeconds;
+    // retained frames: TILE bins redrawn out of all of them
+    long long binsRedrawn, bins;
+
+    RenderStats() {
+        fill_n(seconds, STAT_STAGES, 0.0);
+        fusedTransform = false;
+        verticesTransformed = 0;
+        trianglesIn = trianglesOut = 0;
+        trianglesAccepted = trianglesClipped = trianglesRejected = trianglesCulled = 0;
+        fragmentsTested = fragmentsPassed = 0;
+        hizTilesTested = hizTilesCulled = hizPixelsCulled = 0;
+        blocksFull = blocksPartial = blocksEmpty = 0;
+        pixels = pixelsCovered = 0;
+        unsortedFragmentsPassed = 0;
+        samples = 1;
+        frameBytes = baselineFrameBytes = 0;
+        baselineSeconds = 0;
+        binsRedrawn = bins = 0;
+    }
+
+    void add(RenderStats &s) {
+        for (int k = 0; k < STAT_STAGES; k++) seconds[k] += s.seconds[k];
+        fusedTransform = fusedTransform || s.fusedTransform;
+        verticesTransformed += s.verticesTransformed;
+        trianglesIn += s.trianglesIn;
+        trianglesOut += s.trianglesOut;
+        trianglesAccepted += s.trianglesAccepted;
+        trianglesClipped += s.trianglesClipped;
+        trianglesRejected += s.trianglesRejected;
+        trianglesCulled += s.trianglesCulled;
+        fragmentsTested += s.fragmentsTested;
+        fragmentsPassed += s.fragmentsPassed;
+        hizTilesTested += s.hizTilesTested;
+        hizTilesCulled += s.hizTilesCulled;
+        hizPixelsCulled += s.hizPixelsCulled;
+        blocksFull += s.blocksFull;
+        blocksPartial += s.blocksPartial;
+        blocksEmpty += s.blocksEmpty;
+        pixels += s.pixels;
+        pixelsCovered += s.pixelsCovered;
+        unsortedFragmentsPassed += s.unsortedFragmentsPassed;
+        binsRedrawn += s.binsRedrawn;
+        bins += s.bins;
+    }
+
+    // rasterization and resolve, the part of a frame MSAA makes dearer
+    double pixelSeconds() {
+        return seconds[STAT_RASTER] + seconds[STAT_RESOLVE];
+    }
+
+    // depth writes per covered pixel
+    double overdraw() {
+        return pixelsCovered ? (double)fragmentsPassed/pixelsCovered : 0;
+    }
+
+    double unsortedOverdraw() {
+        return pixelsCovered ? (double)unsortedFragmentsPassed/pixelsCovered : 0;
+    }
+
+    // depth tests per covered pixel
+    double depthComplexity() {
+        return pixelsCovered ? (double)fragmentsTested/pixelsCovered : 0;
+    }
+
+    void print(ostream &os) {
+#if RENDER_STATS
+        ios::fmtflags flags = os.flags();
+        os << fixed << setprecision(3);
+        for (int k = 0; k < STAT_STAGES; k++) {
+            os << statStageNames[k] << ": " << seconds[k]*1000 << " ms\n";
+        }
+        if (fusedTransform) os << "(view and projection fused: counted under modeling, or view for a cached world)\n";
+
+        os << "vertices transformed: " << verticesTransformed << '\n';
+        os << "triangles in: " << trianglesIn << '\n';
+        os << "triangles accepted: " << trianglesAccepted << '\n';
+        os << "triangles clipped: " << trianglesClipped << '\n';
+        os << "triangles rejected: " << trianglesRejected << '\n';
+        os << "triangles culled: " << trianglesCulled << '\n';
+        os << "triangles out: " << trianglesOut << '\n';
+        os << "fragments tested: " << fragmentsTested << '\n';
+        os << "fragments passed: " << fragmentsPassed << '\n';
+        os << "hi-z tiles tested: " << hizTilesTested << '\n';
+        os << "hi-z tiles culled: " << hizTilesCulled << '\n';
+        os << "hi-z pixels culled: " << hizPixelsCulled << '\n';
+        os << "blocks full: " << blocksFull << '\n';
+        os << "blocks partial: " << blocksPartial << '\n';
+        os << "blocks empty: " << blocksEmpty << '\n';
+        os << "pixels covered: " << pixelsCovered << " of " << pixels << '\n';
+        if (unsortedFragmentsPassed) {
+            os << "overdraw before sort: " << unsortedOverdraw() << '\n';
+            os << "overdraw after sort: " << overdraw() << '\n';
+        }
+        else os << "overdraw: " << overdraw() << '\n';
+        os << "depth complexity: " << depthComplexity() << '\n';
+        os << "samples: " << samples << '\n';
+        os << "framebuffer: " << frameBytes << " bytes\n";
+        if (baselineFrameBytes) {
+            os << "memory vs 1x: " << (double)frameBytes/baselineFrameBytes << "x\n";
+            os << "raster time vs 1x: " << pixelSeconds()/baselineSeconds << "x ("
+               << baselineSeconds*1000 << " ms at 1x)\n";
+        }
+        if (bins) os << "tiles redrawn: " << binsRedrawn << " of " << bins << '\n';
+        os.flags(flags);
+#else
+        os << "statistics compiled out (RENDER_STATS=0)\n";
+#endif
+    }
+
+    // one JSON object on one line, tagged with the view (or other frame)
+    // index when there is one
+    void printJson(ostream &os, [[maybe_unused]] int view = -1, [[maybe_unused]] const char *tag = "view") {
+#if RENDER_STATS
+        ios::fmtflags flags = os.flags();
+        os << setprecision(9) << '{';
+        if (view >= 0) os << '"' << tag << "\":" << view << ',';
+        os << "\"seconds\":{";
+        for (int k = 0; k < STAT_STAGES; k++) {
+            os << (k ? "," : "") << '"' << statStageNames[k] << "\":" << seconds[k];
+        }
+        os << "},\"fused_transform\":" << (fusedTransform ? "true" : "false");
+        os << ",\"vertices_transformed\":" << verticesTransformed;
+        os << ",\"triangles\":{\"in\":" << trianglesIn << ",\"accepted\":" << trianglesAccepted
+           << ",\"clipped\":" << trianglesClipped << ",\"rejected\":" << trianglesRejected
+           << ",\"culled\":" << trianglesCulled << ",\"out\":" << trianglesOut << '}';
+        os << ",\"fragments\":{\"tested\":" << fragmentsTested << ",\"passed\":" << fragmentsPassed << '}';
+        os << ",\"hiz\":{\"tiles_tested\":" << hizTilesTested << ",\"tiles_culled\":" << hizTilesCulled
+           << ",\"pixels_culled\":" << hizPixelsCulled << '}';
+        os << ",\"blocks\":{\"full\":" << blocksFull << ",\"partial\":" << blocksPartial
+           << ",\"empty\":" << blocksEmpty << '}';
+        os << ",\"pixels\":{\"total\":" << pixels << ",\"covered\":" << pixelsCovered << '}';
+        if (unsortedFragmentsPassed) os << ",\"overdraw_unsorted\":" << unsortedOverdraw();
+        os << ",\"overdraw\":" << overdraw() << ",\"depth_complexity\":" << depthComplexity();
+        os << ",\"samples\":" << samples << ",\"frame_bytes\":" << frameBytes;
+        if (baselineFrameBytes) {
+            os << ",\"baseline\":{\"frame_bytes\":" << baselineFrameBytes << ",\"seconds\":" << baselineSeconds << '}';
+        }
+        if (bins) os << ",\"tiles\":{\"redrawn\":" << binsRedrawn << ",\"total\":" << bins << '}';
+        os << "}\n";
+        os.flags(flags);
+#else
+        os << "{\"enabled\":false}\n";
+#endif
+    }
+};
+
+
+// adds the lifetime of the scope to a stage's seconds
+struct StageTimer {
+    double &slot;
+    chrono::steady_clock::time_point start;
+
+    StageTimer(double &slot) : slot(slot), start(chrono::steady_clock::now()) {
+    }
+
+    ~StageTimer() {
+        slot += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+};
+
+#if RENDER_STATS
+#define STAT(x) x
+#define STAT_TIME(stats, stage) StageTimer stageTimer((stats).seconds[stage])
+#define STAT_TIME_INTO(seconds) StageTimer stageTimer(seconds)
+#else
+#define STAT(x)
+#define STAT_TIME(stats, stage)
+#define STAT_TIME_INTO(seconds)
+#endif
+
+
+#define GUARD_BAND 4.0
+
+// Clip space half-spaces a*x + b*y + c*z + d*w >= 0. The first six are the
+// view frustum. x and y are only really clipped against the wider guard
+// band planes, because the rasterizer already clamps to the screen.
+const double clipPlanes[10][4] = {
+    {0, 0, 1, 1}, {0, 0, -1, 1},
+    {1, 0, 0, 1}, {-1, 0, 0, 1}, {0, 1, 0, 1}, {0, -1, 0, 1},
+    {1, 0, 0, GUARD_BAND}, {-1, 0, 0, GUARD_BAND}, {0, 1, 0, GUARD_BAND}, {0, -1, 0, GUARD_BAND}
+};
+const int clippedPlanes[6] = {0, 1, 6, 7, 8, 9};
+
+inline double planeDistance(Point &p, int k) {
+    return clipPlanes[k][0]*p.x + clipPlanes[k][1]*p.y + clipPlanes[k][2]*p.z + clipPlanes[k][3]*p.n;
+}
+
+inline int outcode(Point &p) {
+    int code = 0;
+    for (int k = 0; k < 10; k++) {
+        if (planeDistance(p, k) < 0) code |= 1<<k;
+    }
+    return code;
+}
+
+inline Point lerp(Point &a, Point &b, double t) {
+    return Point(a.x + (b.x-a.x)*t, a.y + (b.y-a.y)*t, a.z + (b.z-a.z)*t, a.n + (b.n-a.n)*t);
+}
+
+
+// Rejects clip space triangles that lie entirely outside one frustum plane,
+// clips the ones crossing near, far or the guard band, and finishes with
+// the homogeneous divide.
+inline void clipStage(vector<Triangle> &triangles, [[maybe_unused]] RenderStats &st) {
+    STAT(st.trianglesIn += triangles.size());
+
+    vector<Triangle> out;
+    out.reserve(triangles.size());
+
+    for (Triangle &tr : triangles) {
+        int c0 = outcode(tr.points[0]), c1 = outcode(tr.points[1]), c2 = outcode(tr.points[2]);
+
+        if (c0 & c1 & c2 & 0x3f) {
+            STAT(st.trianglesRejected++);
+            continue;
+        }
+
+        int crossed = (c0 | c1 | c2) & 0x3c3;
+        if (!crossed) {
+            STAT(st.trianglesAccepted++);
+            out.push_back(tr);
+            out.back().project();
+            continue;
+        }
+
+        Point poly[9], next[9];
+        int n = 3;
+        for (int k = 0; k < 3; k++) poly[k] = tr.points[k];
+
+        for (int k : clippedPlanes) {
+            if (!(crossed>>k & 1)) continue;
+
+            int m = 0;
+            for (int a = 0; a < n; a++) {
+                Point &p = poly[a], &q = poly[(a+1)%n];
+                double dp = planeDistance(p, k), dq = planeDistance(q, k);
+
+                if (dp >= 0) next[m++] = p;
+                if ((dp >= 0) != (dq >= 0)) next[m++] = lerp(p, q, dp/(dp-dq));
+            }
+
+            n = m;
+            for (int a = 0; a < n; a++) poly[a] = next[a];
+        }
+
+        if (n < 3) {
+            STAT(st.trianglesRejected++);
+            continue;
+        }
+
+        STAT(st.trianglesClipped++);
+        for (int a = 1; a+1 < n; a++) {
+            out.push_back(tr);
+            out.back().setPoints(poly[0], poly[a], poly[a+1]);
+            out.back().project();
+        }
+    }
+
+    triangles.swap(out);
+}
+
+
+#define TILE 64
+#define HIZ_TILE 8
+
+
+struct Screen {
+    int width, height;
+    double dx, dy;
+    double topY, bottomY, leftX, rightX;
+
+    Screen(int width, int height) {
+        this->width = width;
+        this->height = height;
+        dx = 2.0/width;
+        dy = 2.0/height;
+        topY = 1-dy/2;
+        bottomY = -1+dy/2;
+        leftX = -1+dx/2;
+        rightX = 1-dx/2;
+    }
+};
+
+// inclusive pixel rectangle, columns x0..x1 and rows y0..y1
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+
+// Row-major depth buffer in one aligned block: pixel (x, y) lives at
+// data[y*width + x]. T is float or double.
+template <typename T>
+struct DepthBuffer {
+    int width, height;
+    T *data;
+
+    DepthBuffer(int width, int height) {
+        this->width = width;
+        this->height = height;
+        data = static_cast<T*>(operator new[](sizeof(T)*width*height, align_val_t(64)));
+    }
+    DepthBuffer(const DepthBuffer &) = delete;
+    DepthBuffer &operator=(const DepthBuffer &) = delete;
+
+    ~DepthBuffer() {
+        operator delete[](data, align_val_t(64));
+    }
+
+    void resize(int width, int height) {
+        if (width == this->width && height == this->height) return;
+        operator delete[](data, align_val_t(64));
+        this->width = width;
+        this->height = height;
+        data = static_cast<T*>(operator new[](sizeof(T)*width*height, align_val_t(64)));
+    }
+
+    T &at(int x, int y) {
+        return data[(size_t)y*width + x];
+    }
+
+    T *row(int y) {
+        return data + (size_t)y*width;
+    }
+
+    void clear(T value) {
+        fill_n(data, (size_t)width*height, value);
+    }
+};
+
+
+#define SUBPIXEL_BITS 8
+#define SUBPIXEL (1 << SUBPIXEL_BITS)
+#define SMALL_TRIANGLE 4
+
+
+// Per-sample depth and color of an MSAA frame: sample s of pixel (x, y) is
+// column x*samples + s of both. Colors are packed 0xRRGGBB.
+template <typename T>
+struct SampleBuffer {
+    int samples;
+    DepthBuffer<T> depth;
+    vector<uint32_t> color;
+
+    SampleBuffer() : samples(1), depth(1, 1) {
+    }
+
+    void resize(int width, int height, int samples) {
+        this->samples = samples;
+        depth.resize(width*samples, height);
+        color.resize((size_t)width*samples*height);
+    }
+
+    uint32_t *colorRow(int y) {
+        return color.data() + (size_t)y*depth.width;
+    }
+
+    void clear() {
+        depth.clear(1.0);
+        fill(color.begin(), color.end(), 0);
+    }
+
+    size_t bytes() {
+        return (size_t)depth.width*depth.height*(sizeof(T)+sizeof(uint32_t));
+    }
+};
+
+
+// Sample positions around the pixel center in 1/16 pixel, y down: the
+// usual 2x, 4x (rotated grid) and 8x patterns.
+const int samplePattern2[2][2] = {{4, 4}, {-4, -4}};
+const int samplePattern4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+const int samplePattern8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+inline const int (*samplePattern(int samples))[2] {
+    if (samples == 2) return samplePattern2;
+    if (samples == 4) return samplePattern4;
+    return samplePattern8;
+}
+
+#define MAX_SAMPLES 8
+
+
+// Edge functions and depth plane of a screen-space triangle. Vertices are
+// snapped to 1/SUBPIXEL of a pixel in a y-down frame whose integer points
+// are pixel centers, so at pixel column j, row i an edge is
+// e0 + ex*j + ey*i exactly in 64 bit integers. Edges are oriented so that
+// inside is >= 0; edges that are neither top nor left carry a -1 bias, so a
+// pixel center on an edge shared by two triangles goes to exactly one of
+// them. The depth is z0 + zx*j + zy*i.
+struct TriangleSetup {
+    int64_t e0[3], ex[3], ey[3];
+    double z0, zx, zy;
+    double minZ;
+    bool front;
+    Tile rect;
+};
+
+
+// false if the triangle has no area or covers no pixel center; pad widens
+// the pixel rectangle by that many subpixels for samples off the center
+inline bool setupTriangle(Triangle &tr, Screen &sc, TriangleSetup &ts, int64_t pad = 0) {
+    Point *v = tr.points;
+
+    int64_t X[3], Y[3];
+    for (int k = 0; k < 3; k++) {
+        double x = (v[k].x-sc.leftX)/sc.dx*SUBPIXEL;
+        double y = (sc.topY-v[k].y)/sc.dy*SUBPIXEL;
+        if (x != x || y != y) return false;
+        X[k] = llround(x);
+        Y[k] = llround(y);
+    }
+
+    // >> floors, -(-a >> n) rounds up
+    int64_t minX = min(min(X[0], X[1]), X[2])-pad, maxX = max(max(X[0], X[1]), X[2])+pad;
+    int64_t minY = min(min(Y[0], Y[1]), Y[2])-pad, maxY = max(max(Y[0], Y[1]), Y[2])+pad;
+    ts.rect.x0 = (int)max(-(-minX >> SUBPIXEL_BITS), (int64_t)0);
+    ts.rect.x1 = (int)min(maxX >> SUBPIXEL_BITS, (int64_t)sc.width-1);
+    ts.rect.y0 = (int)max(-(-minY >> SUBPIXEL_BITS), (int64_t)0);
+    ts.rect.y1 = (int)min(maxY >> SUBPIXEL_BITS, (int64_t)sc.height-1);
+
+    // sub-pixel triangles between pixel centers end here
+    if (ts.rect.x0 > ts.rect.x1 || ts.rect.y0 > ts.rect.y1) return false;
+
+    int64_t area = (X[1]-X[0])*(Y[2]-Y[0]) - (Y[1]-Y[0])*(X[2]-X[0]);
+    if (area == 0) return false;
+    int64_t sign = area > 0 ? 1 : -1;
+    // counter-clockwise on screen (y up) faces the camera
+    ts.front = area < 0;
+    double areaAbs = (double)(area*sign);
+
+    ts.minZ = min(min(v[0].z, v[1].z), v[2].z);
+    ts.z0 = ts.zx = ts.zy = 0;
+    for (int k = 0; k < 3; k++) {
+        int a = k, b = (k+1)%3, c = (k+2)%3;
+        int64_t A = (Y[a]-Y[b])*sign, B = (X[b]-X[a])*sign;
+
+        ts.e0[k] = -A*X[a] - B*Y[a];
+        ts.ex[k] = A*SUBPIXEL;
+        ts.ey[k] = B*SUBPIXEL;
+
+        // edge k is zero on a-b and reaches area at the opposite vertex c
+        ts.z0 += ts.e0[k]*v[c].z/areaAbs;
+        ts.zx += ts.ex[k]*v[c].z/areaAbs;
+        ts.zy += ts.ey[k]*v[c].z/areaAbs;
+
+        // y points down: a left edge has the inside to its right, a top
+        // edge is horizontal with the inside below it
+        bool topLeft = A > 0 || (A == 0 && B > 0);
+        if (!topLeft) ts.e0[k] -= 1;
+    }
+
+    return true;
+}
+
+
+// Coarse level over the depth buffer: the farthest depth in each HIZ_TILE square.
+// A tile is only re-scanned when it was written since its last query.
+struct HiZ {
+    int width, height;
+    int tilesX, tilesY;
+    vector<double> maxZ;
+    vector<char> dirty;
+
+    HiZ(Screen &sc) {
+        width = sc.width;
+        height = sc.height;
+        tilesX = (sc.width+HIZ_TILE-1)/HIZ_TILE;
+        tilesY = (sc.height+HIZ_TILE-1)/HIZ_TILE;
+        maxZ.assign(tilesX*tilesY, 1.0);
+        dirty.assign(tilesX*tilesY, 0);
+    }
+
+    template <typename T>
+    double farthest(int tx, int ty, Tile &r, DepthBuffer<T> &depth) {
+        int t = ty*tilesX+tx;
+        if (dirty[t]) {
+            double m = -INFINITY;
+            for (int i = r.y0; i <= r.y1; i++) {
+                T *row = depth.row(i);
+                for (int j = r.x0; j <= r.x1; j++) {
+                    m = max(m, (double)row[j]);
+                }
+            }
+            maxZ[t] = m;
+            dirty[t] = 0;
+        }
+        return maxZ[t];
+    }
+};
+
+
+// half-space rasterization of one set up triangle inside r; true if any
+// pixel was written
+template <typename T>
+bool rasterizeBlock(TriangleSetup &ts, int col[3], Tile &r, DepthBuffer<T> &depth, bitmap_image &image, [[maybe_unused]] RenderStats &st) {
+    bool written = false;
+
+    auto shade = [&](int j, int i, double zp) {
+        if (zp < -1) return;
+        STAT(st.fragmentsTested++);
+        T z = (T)zp;
+        if (z < depth.at(j, i)) {
+            depth.at(j, i) = z;
+            image.set_pixel(j, i, col[0], col[1], col[2]);
+            STAT(st.fragmentsPassed++);
+            written = true;
+        }
+    };
+
+#ifdef __AVX2__
+    // groups of four start on absolute multiples of four, so a pixel
+    // is evaluated the same way whichever tile clips the row
+    __m256i exLane[3], step[3];
+    for (int k = 0; k < 3; k++) {
+        exLane[k] = _mm256_set_epi64x(3*ts.ex[k], 2*ts.ex[k], ts.ex[k], 0);
+        step[k] = _mm256_set1_epi64x(4*ts.ex[k]);
+    }
+    __m256d laneD = _mm256_set_pd(3, 2, 1, 0);
+#endif
+
+    for (int i = r.y0; i <= r.y1; i++) {
+        int64_t e0 = ts.e0[0] + ts.ey[0]*i;
+        int64_t e1 = ts.e0[1] + ts.ey[1]*i;
+        int64_t e2 = ts.e0[2] + ts.ey[2]*i;
+        double z = ts.z0 + ts.zy*i;
+
+#ifdef __AVX2__
+        int j0 = r.x0 & ~3;
+        __m256i w0 = _mm256_add_epi64(_mm256_set1_epi64x(e0 + ts.ex[0]*j0), exLane[0]);
+        __m256i w1 = _mm256_add_epi64(_mm256_set1_epi64x(e1 + ts.ex[1]*j0), exLane[1]);
+        __m256i w2 = _mm256_add_epi64(_mm256_set1_epi64x(e2 + ts.ex[2]*j0), exLane[2]);
+        for (int j = j0; j <= r.x1; j += 4) {
+            // a lane is inside when no edge value has its sign bit set
+            __m256i out = _mm256_or_si256(w0, _mm256_or_si256(w1, w2));
+            int mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 15;
+            w0 = _mm256_add_epi64(w0, step[0]);
+            w1 = _mm256_add_epi64(w1, step[1]);
+            w2 = _mm256_add_epi64(w2, step[2]);
+            if (mask == 0) continue;
+
+            double zs[4];
+            __m256d jv = _mm256_add_pd(_mm256_set1_pd(j), laneD);
+            _mm256_storeu_pd(zs, _mm256_add_pd(_mm256_set1_pd(z), _mm256_mul_pd(_mm256_set1_pd(ts.zx), jv)));
+            for (int l = 0; l < 4; l++) {
+                if ((mask>>l & 1) && j+l >= r.x0 && j+l <= r.x1) shade(j+l, i, zs[l]);
+            }
+        }
+#else
+        for (int j = r.x0; j <= r.x1; j++) {
+            if (((e0 + ts.ex[0]*j) | (e1 + ts.ex[1]*j) | (e2 + ts.ex[2]*j)) >= 0) {
+                shade(j, i, z + ts.zx*j);
+            }
+        }
+#endif
+    }
+
+    return written;
+}
+
+
+enum BlockCoverage { BLOCK_EMPTY, BLOCK_PARTIAL, BLOCK_FULL };
+
+// Edges and depth are linear, so their extremes over r are at its corner
+// pixels. A block is full only if it is also in front of the near plane
+// everywhere, which lets fillBlock skip that test too.
+inline BlockCoverage classifyBlock(TriangleSetup &ts, Tile &r) {
+    bool full = true;
+    for (int k = 0; k < 3; k++) {
+        int64_t e = ts.e0[k] + ts.ex[k]*r.x0 + ts.ey[k]*r.y0;
+        int64_t w = ts.ex[k]*(r.x1-r.x0), h = ts.ey[k]*(r.y1-r.y0);
+        if (e + max(w, (int64_t)0) + max(h, (int64_t)0) < 0) return BLOCK_EMPTY;
+        if (e + min(w, (int64_t)0) + min(h, (int64_t)0) < 0) full = false;
+    }
+    if (!full) return BLOCK_PARTIAL;
+
+    double z = ts.z0 + ts.zx*r.x0 + ts.zy*r.y0 + min(ts.zx*(r.x1-r.x0), 0.0) + min(ts.zy*(r.y1-r.y0), 0.0);
+    return z < -1 ? BLOCK_PARTIAL : BLOCK_FULL;
+}
+
+
+// r lies wholly inside the triangle: depth test along the plane, stepping z
+// by zx, with no edge tests; true if any pixel was written
+template <typename T>
+bool fillBlock(TriangleSetup &ts, int col[3], Tile &r, DepthBuffer<T> &depth, bitmap_image &image, [[maybe_unused]] RenderStats &st) {
+    bool written = false;
+    for (int i = r.y0; i <= r.y1; i++) {
+        T *row = depth.row(i);
+        double z = ts.z0 + ts.zy*i + ts.zx*r.x0;
+        for (int j = r.x0; j <= r.x1; j++, z += ts.zx) {
+            if ((T)z < row[j]) {
+                row[j] = (T)z;
+                image.set_pixel(j, i, col[0], col[1], col[2]);
+                STAT(st.fragmentsPassed++);
+                written = true;
+            }
+        }
+        STAT(st.fragmentsTested += r.x1-r.x0+1);
+    }
+    return written;
+}
+
+
+// Walks the hi-z tiles the triangle overlaps inside clip. Each is first
+// classified against the edges: empty tiles are skipped, tiles whose
+// farthest stored depth is already nearer than the triangle are culled,
+// and the rest are filled whole or rasterized per pixel.
+template <typename T>
+void rasterizeTriangle(TriangleSetup &ts, int col[3], Tile &clip, DepthBuffer<T> &depth, bitmap_image &image, HiZ &hiz, RenderStats &st) {
+    int x0 = max(ts.rect.x0, clip.x0), x1 = min(ts.rect.x1, clip.x1);
+    int y0 = max(ts.rect.y0, clip.y0), y1 = min(ts.rect.y1, clip.y1);
+    if (x0 > x1 || y0 > y1) return;
+
+    // a few pixels at most: the hi-z test (and the rescan of a dirty tile it
+    // can cost) is dearer than just depth testing them
+    if (ts.rect.x1-ts.rect.x0 < SMALL_TRIANGLE && ts.rect.y1-ts.rect.y0 < SMALL_TRIANGLE) {
+        Tile r = {x0, y0, x1, y1};
+        if (rasterizeBlock(ts, col, r, depth, image, st)) {
+            for (int ty = y0/HIZ_TILE; ty <= y1/HIZ_TILE; ty++) {
+                for (int tx = x0/HIZ_TILE; tx <= x1/HIZ_TILE; tx++) {
+                    hiz.dirty[ty*hiz.tilesX+tx] = 1;
+                }
+            }
+        }
+        return;
+    }
+
+    for (int ty = y0/HIZ_TILE; ty <= y1/HIZ_TILE; ty++) {
+        for (int tx = x0/HIZ_TILE; tx <= x1/HIZ_TILE; tx++) {
+            Tile tile = {tx*HIZ_TILE, ty*HIZ_TILE, min((tx+1)*HIZ_TILE, hiz.width)-1, min((ty+1)*HIZ_TILE, hiz.height)-1};
+            Tile r = {max(x0, tile.x0), max(y0, tile.y0), min(x1, tile.x1), min(y1, tile.y1)};
+
+            BlockCoverage coverage = classifyBlock(ts, r);
+            if (coverage == BLOCK_EMPTY) {
+                STAT(st.blocksEmpty++);
+                continue;
+            }
+
+            STAT(st.hizTilesTested++);
+            if (ts.minZ >= hiz.farthest(tx, ty, tile, depth)) {
+                STAT(st.hizTilesCulled++);
+                STAT(st.hizPixelsCulled += (r.x1-r.x0+1)*(r.y1-r.y0+1));
+                continue;
+            }
+
+            bool written;
+            if (coverage == BLOCK_FULL) {
+                STAT(st.blocksFull++);
+                written = fillBlock(ts, col, r, depth, image, st);
+            }
+            else {
+                STAT(st.blocksPartial++);
+                written = rasterizeBlock(ts, col, r, depth, image, st);
+            }
+            if (written) hiz.dirty[ty*hiz.tilesX+tx] = 1;
+        }
+    }
+}
+
+
+// Sample offsets of a triangle's edges and depth from the pixel center. ex
+// and ey are whole multiples of SUBPIXEL, so the edges stay exact.
+struct SampleSetup {
+    int samples;
+    int64_t off[3][MAX_SAMPLES];
+    int64_t minOff[3], maxOff[3];
+    double zoff[MAX_SAMPLES];
+
+    SampleSetup(TriangleSetup &ts, int samples) : samples(samples) {
+        const int (*pattern)[2] = samplePattern(samples);
+        for (int k = 0; k < 3; k++) {
+            minOff[k] = INT64_MAX;
+            maxOff[k] = INT64_MIN;
+        }
+        for (int s = 0; s < samples; s++) {
+            int64_t sx = pattern[s][0]*(SUBPIXEL/16), sy = pattern[s][1]*(SUBPIXEL/16);
+            for (int k = 0; k < 3; k++) {
+                off[k][s] = (ts.ex[k]*sx + ts.ey[k]*sy)/SUBPIXEL;
+                minOff[k] = min(minOff[k], off[k][s]);
+                maxOff[k] = max(maxOff[k], off[k][s]);
+            }
+            zoff[s] = (ts.zx*sx + ts.zy*sy)/SUBPIXEL;
+        }
+    }
+};
+
+
+// Pixels of r for MSAA: each gets a coverage mask from the edges at its
+// samples (all of them when full), the covered samples are depth tested and
+// the fragment's color is written once, to the samples that passed. True if
+// any sample was written.
+template <typename T>
+bool rasterizeSamples(TriangleSetup &ts, SampleSetup &ss, uint32_t rgb, Tile &r, bool full, SampleBuffer<T> &sb, [[maybe_unused]] RenderStats &st) {
+    int S = ss.samples;
+    int allSamples = (1 << S) - 1;
+    bool written = false;
+
+    for (int i = r.y0; i <= r.y1; i++) {
+        T *depth = sb.depth.row(i);
+        uint32_t *color = sb.colorRow(i);
+        int64_t e0 = ts.e0[0] + ts.ex[0]*r.x0 + ts.ey[0]*i;
+        int64_t e1 = ts.e0[1] + ts.ex[1]*r.x0 + ts.ey[1]*i;
+        int64_t e2 = ts.e0[2] + ts.ex[2]*r.x0 + ts.ey[2]*i;
+        double z = ts.z0 + ts.zy*i + ts.zx*r.x0;
+
+        for (int j = r.x0; j <= r.x1; j++, e0 += ts.ex[0], e1 += ts.ex[1], e2 += ts.ex[2], z += ts.zx) {
+            int mask = allSamples;
+            if (!full) {
+                mask = 0;
+                for (int s = 0; s < S; s++) {
+                    if (((e0 + ss.off[0][s]) | (e1 + ss.off[1][s]) | (e2 + ss.off[2][s])) >= 0) mask |= 1 << s;
+                }
+                if (mask == 0) continue;
+            }
+
+            STAT(st.fragmentsTested++);
+            bool passed = false;
+            for (int s = 0; s < S; s++) {
+                if (!(mask>>s & 1)) continue;
+                double zs = z + ss.zoff[s];
+                if (zs < -1) continue;
+                if ((T)zs < depth[j*S+s]) {
+                    depth[j*S+s] = (T)zs;
+                    color[j*S+s] = rgb;
+                    passed = true;
+                }
+            }
+            if (passed) {
+                STAT(st.fragmentsPassed++);
+                written = true;
+            }
+        }
+    }
+    return written;
+}
+
+
+// MSAA counterpart of rasterizeTriangle: the same walk over hi-z tiles,
+// with the block classification widened by the sample offsets and the
+// hi-z level kept over the sample depths.
+template <typename T>
+void rasterizeTriangleMsaa(TriangleSetup &ts, int col[3], Tile &clip, SampleBuffer<T> &sb, HiZ &hiz, RenderStats &st) {
+    int x0 = max(ts.rect.x0, clip.x0), x1 = min(ts.rect.x1, clip.x1);
+    int y0 = max(ts.rect.y0, clip.y0), y1 = min(ts.rect.y1, clip.y1);
+    if (x0 > x1 || y0 > y1) return;
+
+    int S = sb.samples;
+    SampleSetup ss(ts, S);
+    uint32_t rgb = (uint32_t)col[0] << 16 | (uint32_t)col[1] << 8 | (uint32_t)col[2];
+
+    for (int ty = y0/HIZ_TILE; ty <= y1/HIZ_TILE; ty++) {
+        for (int tx = x0/HIZ_TILE; tx <= x1/HIZ_TILE; tx++) {
+            Tile tile = {tx*HIZ_TILE, ty*HIZ_TILE, min((tx+1)*HIZ_TILE, hiz.width)-1, min((ty+1)*HIZ_TILE, hiz.height)-1};
+            Tile r = {max(x0, tile.x0), max(y0, tile.y0), min(x1, tile.x1), min(y1, tile.y1)};
+
+            bool empty = false, full = true;
+            for (int k = 0; k < 3; k++) {
+                int64_t e = ts.e0[k] + ts.ex[k]*r.x0 + ts.ey[k]*r.y0;
+                int64_t w = ts.ex[k]*(r.x1-r.x0), h = ts.ey[k]*(r.y1-r.y0);
+                if (e + max(w, (int64_t)0) + max(h, (int64_t)0) + ss.maxOff[k] < 0) empty = true;
+                if (e + min(w, (int64_t)0) + min(h, (int64_t)0) + ss.minOff[k] < 0) full = false;
+            }
+            if (empty) {
+                STAT(st.blocksEmpty++);
+                continue;
+            }
+
+            Tile samples = {tile.x0*S, tile.y0, tile.x1*S+S-1, tile.y1};
+            STAT(st.hizTilesTested++);
+            if (ts.minZ >= hiz.farthest(tx, ty, samples, sb.depth)) {
+                STAT(st.hizTilesCulled++);
+                STAT(st.hizPixelsCulled += (r.x1-r.x0+1)*(r.y1-r.y0+1));
+                continue;
+            }
+
+            STAT(full ? st.blocksFull++ : st.blocksPartial++);
+            if (rasterizeSamples(ts, ss, rgb, r, full, sb, st)) {
+                hiz.dirty[ty*hiz.tilesX+tx] = 1;
+            }
+        }
+    }
+}
+
+
+// Averages the samples of every pixel into image, and keeps the nearest
+// sample as the pixel's depth.
+template <typename T>
+void resolveSamples(SampleBuffer<T> &sb, DepthBuffer<T> &depth, bitmap_image &image) {
+    int S = sb.samples;
+    for (int i = 0; i < depth.height; i++) {
+        T *sampleDepth = sb.depth.row(i);
+        uint32_t *color = sb.colorRow(i);
+        T *row = depth.row(i);
+
+        for (int j = 0; j < depth.width; j++) {
+            int r = 0, g = 0, b = 0;
+            T z = 1.0;
+            for (int s = 0; s < S; s++) {
+                uint32_t c = color[j*S+s];
+                r += c >> 16 & 255;
+                g += c >> 8 & 255;
+                b += c & 255;
+                z = min(z, sampleDepth[j*S+s]);
+            }
+            image.set_pixel(j, i, (r+S/2)/S, (g+S/2)/S, (b+S/2)/S);
+            row[j] = z;
+        }
+    }
+}
+
+
+// Stable LSD radix sort of triangle indices on min z quantized to 16 bits,
+// nearest first. Near triangles then fill the depth buffer early and far
+// ones fail the depth test (or the whole hi-z tile) instead of being drawn
+// and overwritten. Ties keep scene order.
+inline void sortFrontToBack(vector<int> &order, vector<TriangleSetup> &setups) {
+    int n = order.size();
+    vector<uint16_t> key(setups.size());
+    for (int t : order) {
+        double q = (setups[t].minZ+1)*0.5*65535;
+        key[t] = (uint16_t)max(0.0, min(q, 65535.0));
+    }
+
+    vector<int> tmp(n);
+    for (int shift = 0; shift < 16; shift += 8) {
+        int count[257] = {0};
+        for (int t : order) count[((key[t] >> shift) & 255)+1]++;
+        for (int b = 0; b < 256; b++) count[b+1] += count[b];
+        for (int t : order) tmp[count[(key[t] >> shift) & 255]++] = t;
+        order.swap(tmp);
+    }
+}
+
+
+// Sorts triangles into TILE x TILE screen bins and lets each worker own
+// whole tiles, so no two threads ever write the same pixel. Every bin keeps
+// the triangles in submission order, which keeps the image identical to the
+// single threaded path. With msaa the triangles go to its samples instead
+// of depth and image.
+template <typename T>
+void rasterize(vector<Triangle> &triangles, Screen &sc, DepthBuffer<T> &depth, bitmap_image &image, HiZ &hiz, RenderStats &stats, RenderOptions &opt, SampleBuffer<T> *msaa = nullptr) {
+    int threads = opt.threads;
+    // samples lie within half a pixel of the center
+    int64_t pad = msaa ? SUBPIXEL/2 : 0;
+    vector<TriangleSetup> setups(triangles.size());
+    vector<int> visible;
+    visible.reserve(triangles.size());
+    for (int t = 0; t < (int)triangles.size(); t++) {
+        if (!setupTriangle(triangles[t], sc, setups[t], pad)) continue;
+
+        if ((opt.cull == CULL_BACK && !setups[t].front) || (opt.cull == CULL_FRONT && setups[t].front)) {
+            STAT(stats.trianglesCulled++);
+            continue;
+        }
+        visible.push_back(t);
+    }
+    STAT(stats.trianglesOut += visible.size());
+
+    // binning keeps this order, so every tile's list is sorted as well
+    if (opt.sortFrontToBack) sortFrontToBack(visible, setups);
+
+    auto draw = [&](int t, Tile &clip, RenderStats &st) {
+        if (msaa) rasterizeTriangleMsaa(setups[t], triangles[t].col, clip, *msaa, hiz, st);
+        else rasterizeTriangle(setups[t], triangles[t].col, clip, depth, image, hiz, st);
+    };
+
+    if (threads <= 1) {
+        Tile screen = {0, 0, sc.width-1, sc.height-1};
+        for (int t : visible) {
+            draw(t, screen, stats);
+        }
+        return;
+    }
+
+    int tilesX = (sc.width+TILE-1)/TILE;
+    int tilesY = (sc.height+TILE-1)/TILE;
+    vector<vector<int>> bins(tilesX*tilesY);
+
+    for (int t : visible) {
+        Tile &rect = setups[t].rect;
+        for (int ty = rect.y0/TILE; ty <= rect.y1/TILE; ty++) {
+            for (int tx = rect.x0/TILE; tx <= rect.x1/TILE; tx++) {
+                bins[ty*tilesX+tx].push_back(t);
+            }
+        }
+    }
+
+    vector<RenderStats> threadStats(threads);
+    atomic<int> next(0);
+    auto worker = [&](RenderStats &st) {
+        int b;
+        while ((b = next++) < (int)bins.size()) {
+            int tx = b%tilesX, ty = b/tilesX;
+            Tile tile = {tx*TILE, ty*TILE, min((tx+1)*TILE, sc.width)-1, min((ty+1)*TILE, sc.height)-1};
+
+            for (int t : bins[b]) {
+                draw(t, tile, st);
+            }
+        }
+    };
+
+    vector<thread> pool;
+    for (int i = 0; i < threads; i++) {
+        pool.push_back(thread(worker, ref(threadStats[i])));
+    }
+    for (int i = 0; i < threads; i++) {
+        pool[i].join();
+        STAT(stats.add(threadStats[i]));
+    }
+}
+
+
+enum DepthFormat { DEPTH_TEXT, DEPTH_RAW, DEPTH_PFM, DEPTH_BMP };
+
+// Raw depth dump: this header, then width*height float32 depths row by row
+// from the top, 1 where nothing was drawn. Native byte order.
+struct DepthHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t scalarSize;
+    uint32_t reserved;
+};
+
+const char depthMagic[4] = {'D', 'P', 'T', 'H'};
+
+
+// The classic z_buffer.txt: covered depths of each row, tab separated. The
+// whole file is formatted with to_chars into one buffer and written at once.
+template <typename T>
+void writeDepthText(const char *fileName, DepthBuffer<T> &depth) {
+    vector<char> text;
+    text.reserve((size_t)depth.width*depth.height*4);
+
+    char num[64];
+    for (int i = 0; i < depth.height; i++) {
+        T *row = depth.row(i);
+        for (int j = 0; j < depth.width; j++) {
+            if (row[j] < 1.0) {
+                char *e = to_chars(num, num+sizeof(num), (double)row[j], chars_format::fixed, 6).ptr;
+                *e++ = '\t';
+                text.insert(text.end(), num, e);
+            }
+        }
+        text.push_back('\n');
+    }
+
+    ofstream out(fileName, ios::binary);
+    out.write(text.data(), text.size());
+}
+
+
+// rows from the top if topFirst, else from the bottom
+template <typename T>
+vector<float> depthFloats(DepthBuffer<T> &depth, bool topFirst) {
+    vector<float> v((size_t)depth.width*depth.height);
+    for (int i = 0; i < depth.height; i++) {
+        T *row = depth.row(topFirst ? i : depth.height-1-i);
+        copy(row, row + depth.width, v.begin() + (size_t)i*depth.width);
+    }
+    return v;
+}
+
+
+template <typename T>
+void writeDepthRaw(const char *fileName, DepthBuffer<T> &depth) {
+    DepthHeader h;
+    memcpy(h.magic, depthMagic, 4);
+    h.version = 1;
+    h.width = depth.width;
+    h.height = depth.height;
+    h.scalarSize = sizeof(float);
+    h.reserved = 0;
+
+    vector<float> v = depthFloats(depth, true);
+    ofstream out(fileName, ios::binary);
+    out.write((const char*)&h, sizeof(h));
+    out.write((const char*)v.data(), v.size()*sizeof(float));
+}
+
+
+// Portable float map: grayscale "Pf", rows from the bottom, a negative
+// scale marking little endian data.
+template <typename T>
+void writeDepthPfm(const char *fileName, DepthBuffer<T> &depth) {
+    uint16_t one = 1;
+    bool little = *(uint8_t*)&one == 1;
+    string header = "Pf\n" + to_string(depth.width) + " " + to_string(depth.height) + "\n" + (little ? "-1.0" : "1.0") + "\n";
+
+    vector<float> v = depthFloats(depth, false);
+    ofstream out(fileName, ios::binary);
+    out.write(header.data(), header.size());
+    out.write((const char*)v.data(), v.size()*sizeof(float));
+}
+
+
+// Covered depths through jet_colormap, stretched over the depth range of
+// the frame: nearest red, farthest blue, background black.
+template <typename T>
+void writeDepthBmp(const char *fileName, DepthBuffer<T> &depth) {
+    double nearest = 1, farthest = -1;
+    for (int i = 0; i < depth.height; i++) {
+        T *row = depth.row(i);
+        for (int j = 0; j < depth.width; j++) {
+            if (row[j] < 1.0) {
+                nearest = min(nearest, (double)row[j]);
+                farthest = max(farthest, (double)row[j]);
+            }
+        }
+    }
+    double scale = farthest > nearest ? 999/(farthest-nearest) : 0;
+
+    bitmap_image image(depth.width, depth.height);
+    for (int i = 0; i < depth.height; i++) {
+        T *row = depth.row(i);
+        for (int j = 0; j < depth.width; j++) {
+            if (row[j] < 1.0) {
+                const rgb_store &c = jet_colormap[999 - (int)((row[j]-nearest)*scale)];
+                image.set_pixel(j, i, c.red, c.green, c.blue);
+            }
+        }
+    }
+    image.save_image(fileName);
+}
+
+
+template <typename T>
+void writeDepth(const char *fileName, DepthBuffer<T> &depth, DepthFormat format = DEPTH_TEXT) {
+    if (format == DEPTH_RAW) writeDepthRaw(fileName, depth);
+    else if (format == DEPTH_PFM) writeDepthPfm(fileName, depth);
+    else if (format == DEPTH_BMP) writeDepthBmp(fileName, depth);
+    else writeDepthText(fileName, depth);
+}
+
+template <typename T>
+struct RenderResult {
+    bitmap_image image;
+    DepthBuffer<T> depth;
+    RenderStats stats;
+    // per-sample storage, sized on the first MSAA frame
+    SampleBuffer<T> msaa;
+
+    RenderResult() : image(1, 1), depth(1, 1) {
+    }
+
+    void resize(int width, int height) {
+        if ((int)image.width() != width || (int)image.height() != height) {
+            image.setwidth_height(width, height);
+        }
+        depth.resize(width, height);
+    }
+};
+
+
+// The matrix stack of the modeling commands. apply() runs one command and
+// emits a triangle transformed by base*model; the product is rebuilt only
+// when the top of the stack changes, and no homogeneous divide is done. A
+// triangle's color comes from its position in the scene.
+//
+// A mesh goes through transformMesh(), which transforms each of its
+// vertices once into cache with the batched Matrix::transform(), and
+// emitMesh(), which assembles triangles from the cache by index.
+struct ModelingState {
+    Matrix base;
+    stack<Matrix> st;
+    Matrix mvp;
+    bool stackChanged;
+    uint64_t seed, index;
+    PointArray cache;
+    long long vertices;
+
+    ModelingState(Matrix &base, uint64_t seed) : base(base), seed(seed) {
+        Matrix mat1;
+        mat1.identity();
+        st.push(mat1);
+        stackChanged = true;
+        index = 0;
+        vertices = 0;
+    }
+
+    void push() {
+        st.push(st.top());
+    }
+
+    void pop() {
+        if (st.size() > 1) {
+            st.pop();
+            stackChanged = true;
+        }
+    }
+
+    Matrix &current() {
+        if (stackChanged) {
+            mvp = base*st.top();
+            stackChanged = false;
+        }
+        return mvp;
+    }
+
+    void transformMesh(Mesh &m) {
+        current().transform(m.vertices, 0, m.vertices.size(), cache);
+        vertices += m.vertices.size();
+    }
+
+    // triangles first .. first+count-1 of the mesh last transformed
+    void emitMesh(Mesh &m, size_t first, size_t count, vector<Triangle> &triangles) {
+        for (size_t t = first; t < first+count; t++) {
+            int *i = &m.indices[t*3];
+            triangles.push_back(Triangle(cache[i[0]], cache[i[1]], cache[i[2]], seed, index++));
+        }
+    }
+
+    void apply(SceneCommand &c, vector<Triangle> &triangles) {
+        if (c.type == CMD_TRIANGLE) {
+            Matrix &mvp = current();
+            vertices += 3;
+            triangles.push_back(Triangle(mvp.transform(c.p[0]), mvp.transform(c.p[1]), mvp.transform(c.p[2]), seed, index++));
+        }
+        else if (c.type == CMD_PUSH) {
+            push();
+        }
+        else if (c.type == CMD_POP) {
+            pop();
+        }
+        else {
+            Matrix t = st.top()*commandMatrix(c);
+            st.pop();
+            st.push(t);
+            stackChanged = true;
+        }
+    }
+};
+
+
+// Runs one command of scene, expanding instances and repeats from
+// scene.blocks as it goes. flush() is called whenever triangles reaches
+// chunk, so a caller can consume them as they come instead of holding the
+// whole expansion.
+template <typename F>
+void runCommand(Scene &scene, SceneCommand &c, ModelingState &model, vector<Triangle> &triangles, size_t chunk, F &flush) {
+    if (c.type == CMD_MESH) {
+        Mesh &m = scene.meshes[c.index];
+        model.transformMesh(m);
+        for (size_t t = 0; t < m.triangles(); ) {
+            size_t n = min(m.triangles()-t, chunk-triangles.size());
+            model.emitMesh(m, t, n, triangles);
+            t += n;
+            if (triangles.size() >= chunk) flush();
+        }
+    }
+    else if (c.type == CMD_INSTANCE || c.type == CMD_REPEAT) {
+        int passes = c.type == CMD_INSTANCE ? 1 : c.count;
+        model.push();
+        for (int k = 0; k < passes; k++) {
+            for (SceneCommand &b : scene.blocks[c.index]) {
+                runCommand(scene, b, model, triangles, chunk, flush);
+            }
+        }
+        model.pop();
+    }
+    else {
+        model.apply(c, triangles);
+        if (triangles.size() >= chunk) flush();
+    }
+}
+
+
+// returns the number of vertices transformed
+inline long long modelingStage(Scene &scene, Matrix &base, vector<Triangle> &triangles, uint64_t seed) {
+    ModelingState model(base, seed);
+    auto flush = []() {};
+    for (SceneCommand &c : scene.commands) {
+        runCommand(scene, c, model, triangles, SIZE_MAX, flush);
+    }
+    return model.vertices;
+}
+
+inline long long modelingStage(SceneProgram &prog, Matrix &base, vector<Triangle> &triangles, uint64_t seed) {
+    return runProgram(prog, base, triangles, seed);
+}
+
+
+template <typename T>
+void countCovered([[maybe_unused]] RenderResult<T> &result) {
+#if RENDER_STATS
+    RenderStats &st = result.stats;
+    DepthBuffer<T> &depth = result.depth;
+    st.pixels += (long long)depth.width*depth.height;
+    for (int i = 0; i < depth.height; i++) {
+        T *row = depth.row(i);
+        for (int j = 0; j < depth.width; j++) {
+            if (row[j] < 1.0) st.pixelsCovered++;
+        }
+    }
+#endif
+}
+
+
+// Clears the result for a new frame. With MSAA the sample buffer is
+// cleared too and returned, to be rasterized into.
+template <typename T>
+SampleBuffer<T> *beginFrame(RenderOptions &opt, RenderResult<T> &result) {
+    STAT_TIME(result.stats, STAT_RASTER);
+    int width = result.depth.width, height = result.depth.height;
+    result.image.clear();
+    result.depth.clear(1.0);
+
+    STAT(result.stats.samples = max(opt.samples, 1));
+    STAT(result.stats.frameBytes = (long long)width*height*(sizeof(T)+3));
+    if (opt.samples <= 1) return nullptr;
+
+    result.msaa.resize(width, height, opt.samples);
+    result.msaa.clear();
+    STAT(result.stats.frameBytes += result.msaa.bytes());
+    return &result.msaa;
+}
+
+
+template <typename T>
+void endFrame(RenderOptions &opt, RenderResult<T> &result) {
+    if (opt.samples > 1) {
+        STAT_TIME(result.stats, STAT_RESOLVE);
+        resolveSamples(result.msaa, result.depth, result.image);
+    }
+    countCovered(result);
+}
+
+
+// Clip stage output to pixels: clears the result and rasterizes.
+template <typename T>
+void rasterizeFrame(vector<Triangle> &triangles, RenderOptions &opt, RenderResult<T> &result) {
+    Screen sc(result.depth.width, result.depth.height);
+    SampleBuffer<T> *msaa = beginFrame(opt, result);
+
+    HiZ hiz(sc);
+    {
+        STAT_TIME(result.stats, STAT_RASTER);
+        rasterize(triangles, sc, result.depth, result.image, hiz, result.stats, opt, msaa);
+    }
+    endFrame(opt, result);
+}
+
+
+// Renders scene into result, reusing its buffers when the size matches.
+// scene is a Scene or a compiled SceneProgram.
+template <typename T, typename S>
+void render(S &scene, Config &config, RenderOptions &opt, RenderResult<T> &result) {
+    result.resize(config.screenWidth, config.screenHeight);
+    result.stats = RenderStats();
+
+    Camera &cam = scene.camera;
+    Matrix view;
+    view.viewMatrix(cam.eye, cam.look, cam.up);
+    Matrix projection;
+    projection.projectionMatrix(cam.fovY, cam.aspect, cam.near, cam.far);
+
+    RenderStats &st = result.stats;
+    vector<Triangle> triangles;
+    if (opt.dumpStages) {
+        Matrix world;
+        world.identity();
+        {
+            STAT_TIME(st, STAT_MODELING);
+            st.verticesTransformed += modelingStage(scene, world, triangles, opt.colorSeed);
+        }
+        {
+            STAT_TIME(st, STAT_OUTPUT);
+            writeStage(opt.stagePrefix, 1, triangles, opt.stageFormat);
+        }
+
+        {
+            STAT_TIME(st, STAT_VIEW);
+            transformStage(triangles, view);
+        }
+        {
+            STAT_TIME(st, STAT_OUTPUT);
+            writeStage(opt.stagePrefix, 2, triangles, opt.stageFormat);
+        }
+
+        {
+            STAT_TIME(st, STAT_PROJECTION);
+            transformStage(triangles, projection);
+            STAT(st.verticesTransformed += 6*triangles.size());
+        }
+
+        // stage3 is the divided projection of every stage2 triangle, line
+        // for line; clipping works on the undivided ones and only feeds the
+        // rasterizer
+        STAT_TIME(st, STAT_OUTPUT);
+        vector<Triangle> projected = triangles;
+        for (Triangle &tr : projected) {
+            tr.project();
+        }
+        writeStage(opt.stagePrefix, 3, projected, opt.stageFormat);
+    }
+    else {
+        STAT(st.fusedTransform = true);
+        STAT_TIME(st, STAT_MODELING);
+        Matrix viewProjection = projection*view;
+        st.verticesTransformed += modelingStage(scene, viewProjection, triangles, opt.colorSeed);
+    }
+
+    {
+        STAT_TIME(st, STAT_CLIPPING);
+        clipStage(triangles, st);
+    }
+
+    rasterizeFrame(triangles, opt, result);
+}
+
+
+// World space triangles of a scene: the modeling stage does not depend on
+// the camera, so it is run once and shared by every view.
+template <typename S>
+void buildWorld(S &scene, vector<Triangle> &world, uint64_t colorSeed) {
+    world.clear();
+
+    Matrix base;
+    base.identity();
+    modelingStage(scene, base, world, colorSeed);
+}
+
+
+// Renders one view of a cached world. triangles is scratch space, reused
+// between calls to avoid reallocating it for every view.
+template <typename T>
+void renderView(vector<Triangle> &world, View &view, RenderOptions &opt, RenderResult<T> &result, vector<Triangle> &triangles) {
+    result.resize(view.config.screenWidth, view.config.screenHeight);
+    result.stats = RenderStats();
+
+    Camera &cam = view.camera;
+    Matrix viewMatrix;
+    viewMatrix.viewMatrix(cam.eye, cam.look, cam.up);
+    Matrix projection;
+    projection.projectionMatrix(cam.fovY, cam.aspect, cam.near, cam.far);
+    Matrix viewProjection = projection*viewMatrix;
+
+    STAT(result.stats.fusedTransform = true);
+    {
+        STAT_TIME(result.stats, STAT_VIEW);
+        triangles.resize(world.size());
+        for (size_t t = 0; t < world.size(); t++) {
+            Point *v = world[t].points;
+            triangles[t] = world[t];
+            triangles[t].setPoints(viewProjection.transform(v[0]), viewProjection.transform(v[1]), viewProjection.transform(v[2]));
+        }
+        STAT(result.stats.verticesTransformed += 3*world.size());
+    }
+
+    {
+        STAT_TIME(result.stats, STAT_CLIPPING);
+        clipStage(triangles, result.stats);
+    }
+    rasterizeFrame(triangles, opt, result);
+}
+
+
+// Renders every view of a cached world and hands each finished frame to
+// onFrame(index, result). With parallelViews the views themselves are spread
+// over opt.threads workers, each rasterizing single threaded; otherwise the
+// views run one after another with tile parallel rasterization.
+template <typename T, typename F>
+void renderViews(vector<Triangle> &world, vector<View> &views, RenderOptions &opt, bool parallelViews, F onFrame) {
+    int workers = parallelViews ? max(min(opt.threads, (int)views.size()), 1) : 1;
+
+    RenderOptions viewOpt = opt;
+    if (parallelViews) viewOpt.threads = 1;
+
+    atomic<int> next(0);
+    auto worker = [&]() {
+        RenderResult<T> result;
+        vector<Triangle> triangles;
+        int v;
+        while ((v = next++) < (int)views.size()) {
+            renderView(world, views[v], viewOpt, result, triangles);
+            onFrame(v, result);
+        }
+    };
+
+    vector<thread> pool;
+    for (int i = 1; i < workers; i++) {
+        pool.push_back(thread(worker));
+    }
+    worker();
+    for (thread &th : pool) {
+        th.join();
+    }
+}
+
+
+// World space triangles of scene split into the objects an edit list
+// refers to: object k is world[objects[k]] .. world[objects[k+1]-1], the
+// output of the k-th top-level triangle, mesh, instance or repeat command.
+inline void buildObjects(Scene &scene, vector<Triangle> &world, vector<size_t> &objects, uint64_t colorSeed) {
+    world.clear();
+    objects.assign(1, 0);
+
+    Matrix base;
+    base.identity();
+    ModelingState model(base, colorSeed);
+    auto flush = []() {};
+    for (SceneCommand &c : scene.commands) {
+        runCommand(scene, c, model, world, SIZE_MAX, flush);
+        if (c.type == CMD_TRIANGLE || c.type == CMD_MESH || c.type == CMD_INSTANCE || c.type == CMD_REPEAT) {
+            objects.push_back(world.size());
+        }
+    }
+}
+
+
+struct RetainedTriangle {
+    TriangleSetup ts;
+    int col[3];
+};
+
+
+// A frame kept between edits. Every object keeps its clipped, set up
+// triangles, and every TILE x TILE bin the list of the triangles touching
+// it as (object << 32 | triangle), which sorts in scene order. An edit
+// re-clips only the object it moves and redraws only the bins its old or
+// new triangles touch, so it costs in proportion to the screen area it
+// changes instead of the whole scene. Frames match render() at 1x without
+// the front to back sort; a retained frame does neither.
+template <typename T>
+struct RetainedFrame {
+    vector<Triangle> &world;
+    vector<size_t> &objects;
+    RenderOptions opt;
+    Screen sc;
+    HiZ hiz;
+    Matrix viewProjection;
+    RenderResult<T> result;
+
+    int tilesX, tilesY;
+    vector<vector<RetainedTriangle>> drawn;
+    vector<vector<uint64_t>> bins, pending;
+    // bins to redraw for the next frame, each listed once
+    vector<int> dirty;
+    vector<char> isDirty;
+    // bins the object being placed touches, found once each by stamp
+    vector<int> touched, stamp;
+    int stampCount;
+    // covered pixels per bin, kept so a frame is counted without a full scan
+    vector<long long> binCovered;
+    long long covered;
+    vector<Triangle> scratch;
+
+    RetainedFrame(vector<Triangle> &world, vector<size_t> &objects, View &view, RenderOptions &opt)
+        : world(world), objects(objects), opt(opt), sc(view.config.screenWidth, view.config.screenHeight), hiz(sc) {
+        Camera &cam = view.camera;
+        Matrix viewMatrix;
+        viewMatrix.viewMatrix(cam.eye, cam.look, cam.up);
+        Matrix projection;
+        projection.projectionMatrix(cam.fovY, cam.aspect, cam.near, cam.far);
+        viewProjection = projection*viewMatrix;
+
+        result.resize(sc.width, sc.height);
+        result.image.clear();
+        result.depth.clear(1.0);
+
+        tilesX = (sc.width+TILE-1)/TILE;
+        tilesY = (sc.height+TILE-1)/TILE;
+        drawn.resize(objects.size()-1);
+        bins.resize(tilesX*tilesY);
+        pending.resize(tilesX*tilesY);
+        isDirty.assign(tilesX*tilesY, 0);
+        stamp.assign(tilesX*tilesY, 0);
+        stampCount = 0;
+        binCovered.assign(tilesX*tilesY, 0);
+        covered = 0;
+    }
+
+    int objectCount() {
+        return drawn.size();
+    }
+
+    template <typename F>
+    void forBins(Tile &rect, F f) {
+        for (int ty = rect.y0/TILE; ty <= rect.y1/TILE; ty++) {
+            for (int tx = rect.x0/TILE; tx <= rect.x1/TILE; tx++) {
+                f(ty*tilesX+tx);
+            }
+        }
+    }
+
+    // Clips and sets up object k from world again and replaces its entries
+    // in the bin lists. Every bin its old or new triangles touch is dirty.
+    void place(int k, RenderStats &st) {
+        stampCount++;
+        touched.clear();
+        auto touch = [&](int b) {
+            if (stamp[b] != stampCount) {
+                stamp[b] = stampCount;
+                touched.push_back(b);
+            }
+            if (!isDirty[b]) {
+                isDirty[b] = 1;
+                dirty.push_back(b);
+            }
+        };
+        for (RetainedTriangle &d : drawn[k]) {
+            forBins(d.ts.rect, touch);
+        }
+
+        {
+            STAT_TIME(st, STAT_VIEW);
+            scratch.assign(world.begin()+objects[k], world.begin()+objects[k+1]);
+            for (Triangle &tr : scratch) {
+                Point *v = tr.points;
+                tr.setPoints(viewProjection.transform(v[0]), viewProjection.transform(v[1]), viewProjection.transform(v[2]));
+            }
+            STAT(st.verticesTransformed += 3*scratch.size());
+        }
+        {
+            STAT_TIME(st, STAT_CLIPPING);
+            clipStage(scratch, st);
+        }
+
+        STAT_TIME(st, STAT_RASTER);
+        vector<RetainedTriangle> &list = drawn[k];
+        list.clear();
+        for (Triangle &tr : scratch) {
+            RetainedTriangle d;
+            if (!setupTriangle(tr, sc, d.ts)) continue;
+
+            if ((opt.cull == CULL_BACK && !d.ts.front) || (opt.cull == CULL_FRONT && d.ts.front)) {
+                STAT(st.trianglesCulled++);
+                continue;
+            }
+            copy(tr.col, tr.col+3, d.col);
+
+            uint64_t entry = (uint64_t)k << 32 | list.size();
+            forBins(d.ts.rect, [&](int b) {
+                touch(b);
+                pending[b].push_back(entry);
+            });
+            list.push_back(d);
+        }
+        STAT(st.trianglesOut += list.size());
+
+        // the entries of object k are one run of each sorted list
+        uint64_t first = (uint64_t)k << 32, last = (uint64_t)(k+1) << 32;
+        for (int b : touched) {
+            vector<uint64_t> &bin = bins[b];
+            auto lo = lower_bound(bin.begin(), bin.end(), first);
+            auto hi = lower_bound(lo, bin.end(), last);
+            lo = bin.erase(lo, hi);
+            bin.insert(lo, pending[b].begin(), pending[b].end());
+            pending[b].clear();
+        }
+    }
+
+    // Clears bin b and draws its list into it again.
+    void drawBin(int b, RenderStats &st) {
+        int tx = b%tilesX, ty = b/tilesX;
+        Tile tile = {tx*TILE, ty*TILE, min((tx+1)*TILE, sc.width)-1, min((ty+1)*TILE, sc.height)-1};
+        DepthBuffer<T> &depth = result.depth;
+        for (int i = tile.y0; i <= tile.y1; i++) {
+            fill(depth.row(i)+tile.x0, depth.row(i)+tile.x1+1, (T)1.0);
+            memset(result.image.row(i) + tile.x0*3, 0, (tile.x1-tile.x0+1)*3);
+        }
+        for (int hy = tile.y0/HIZ_TILE; hy <= tile.y1/HIZ_TILE; hy++) {
+            for (int hx = tile.x0/HIZ_TILE; hx <= tile.x1/HIZ_TILE; hx++) {
+                hiz.dirty[hy*hiz.tilesX+hx] = 1;
+            }
+        }
+
+        for (uint64_t e : bins[b]) {
+            RetainedTriangle &d = drawn[e >> 32][e & 0xffffffff];
+            rasterizeTriangle(d.ts, d.col, tile, depth, result.image, hiz, st);
+        }
+
+#if RENDER_STATS
+        long long n = 0;
+        for (int i = tile.y0; i <= tile.y1; i++) {
+            T *row = depth.row(i);
+            for (int j = tile.x0; j <= tile.x1; j++) {
+                if (row[j] < 1.0) n++;
+            }
+        }
+        binCovered[b] = n;
+#endif
+    }
+
+    // Redraws the dirty bins, spread over opt.threads workers as in
+    // rasterize().
+    void finish(RenderStats &st) {
+#if RENDER_STATS
+        for (int b : dirty) {
+            covered -= binCovered[b];
+        }
+#endif
+        {
+            STAT_TIME(st, STAT_RASTER);
+            int threads = min(opt.threads, (int)dirty.size());
+            if (threads <= 1) {
+                for (int b : dirty) {
+                    drawBin(b, st);
+                }
+            }
+            else {
+                vector<RenderStats> threadStats(threads);
+                atomic<int> next(0);
+                auto worker = [&](RenderStats &ts) {
+                    int d;
+                    while ((d = next++) < (int)dirty.size()) {
+                        drawBin(dirty[d], ts);
+                    }
+                };
+
+                vector<thread> pool;
+                for (int i = 0; i < threads; i++) {
+                    pool.push_back(thread(worker, ref(threadStats[i])));
+                }
+                for (int i = 0; i < threads; i++) {
+                    pool[i].join();
+                    STAT(st.add(threadStats[i]));
+                }
+            }
+        }
+
+        for (int b : dirty) {
+            STAT(covered += binCovered[b]);
+            isDirty[b] = 0;
+        }
+        STAT(st.fusedTransform = true);
+        STAT(st.pixels = (long long)sc.width*sc.height);
+        STAT(st.pixelsCovered = covered);
+        STAT(st.frameBytes = (long long)sc.width*sc.height*(sizeof(T)+3));
+        STAT(st.binsRedrawn = dirty.size());
+        STAT(st.bins = bins.size());
+        dirty.clear();
+    }
+
+    // the first frame: every object placed and every bin drawn
+    void render() {
+        result.stats = RenderStats();
+        for (int k = 0; k < objectCount(); k++) {
+            place(k, result.stats);
+        }
+        finish(result.stats);
+    }
+
+    // Moves object k by m in world space and redraws what that changes.
+    void edit(int k, Matrix &m) {
+        result.stats = RenderStats();
+        RenderStats &st = result.stats;
+        {
+            STAT_TIME(st, STAT_MODELING);
+            for (size_t t = objects[k]; t < objects[k+1]; t++) {
+                Point *v = world[t].points;
+                world[t].setPoints(m.transform(v[0]), m.transform(v[1]), m.transform(v[2]));
+            }
+            STAT(st.verticesTransformed += 3*(objects[k+1]-objects[k]));
+        }
+        place(k, st);
+        finish(st);
+    }
+};
+
+#define STREAM_CHUNK 65536
+
+// Renders scene.txt without holding its commands or triangles: commands are
+// read through a SceneStream, and every chunk of STREAM_CHUNK triangles is
+// clipped and rasterized into the frame before the next is read. Memory is
+// the frame, the matrix stack, one chunk and the mesh being drawn, whatever
+// the scene size. Chunks go through in scene order, so the frame matches
+// render(). With opt.sortFrontToBack each chunk is sorted on its own, so
+// triangles at equal depth can then resolve differently. Stage dumps are not
+// written. Parsing is timed together with modeling.
+template <typename T>
+bool renderStream(const char *fileName, Config &config, RenderOptions &opt, RenderResult<T> &result, size_t chunk = STREAM_CHUNK) {
+    result.resize(config.screenWidth, config.screenHeight);
+    result.stats = RenderStats();
+    RenderStats &st = result.stats;
+    STAT(st.fusedTransform = true);
+
+    SceneStream in;
+    Camera cam;
+    if (!in.open(fileName, cam)) return false;
+
+    Matrix view;
+    view.viewMatrix(cam.eye, cam.look, cam.up);
+    Matrix projection;
+    projection.projectionMatrix(cam.fovY, cam.aspect, cam.near, cam.far);
+    Matrix viewProjection = projection*view;
+
+    Screen sc(config.screenWidth, config.screenHeight);
+    SampleBuffer<T> *msaa = beginFrame(opt, result);
+    HiZ hiz(sc);
+
+    ModelingState model(viewProjection, opt.colorSeed);
+    vector<Triangle> triangles;
+    triangles.reserve(chunk);
+
+    auto flush = [&]() {
+        {
+            STAT_TIME(st, STAT_CLIPPING);
+            clipStage(triangles, st);
+        }
+        {
+            STAT_TIME(st, STAT_RASTER);
+            rasterize(triangles, sc, result.depth, result.image, hiz, st, opt, msaa);
+        }
+        triangles.clear();
+    };
+
+#if RENDER_STATS
+    // modeling is whatever the loop spends outside flush()
+    double loop = 0, flushed = st.seconds[STAT_CLIPPING] + st.seconds[STAT_RASTER];
+#endif
+    {
+        STAT_TIME_INTO(loop);
+        SceneCommand c;
+        bool done = false;
+        while (true) {
+            if (!in.next(c, done)) return false;
+            if (done) break;
+
+            runCommand(in.defs, c, model, triangles, chunk, flush);
+            // nothing refers back to a top level mesh
+            if (c.type == CMD_MESH) in.defs.meshes[c.index] = Mesh();
+        }
+        if (!triangles.empty()) flush();
+    }
+#if RENDER_STATS
+    st.seconds[STAT_MODELING] += loop - (st.seconds[STAT_CLIPPING] + st.seconds[STAT_RASTER] - flushed);
+#endif
+
+    STAT(st.verticesTransformed += model.vertices);
+    endFrame(opt, result);
+    return true;
+}
+
+
+} // namespace offline2
+
+#endif
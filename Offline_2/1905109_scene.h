@@ -0,0 +1,763 @@
+#ifndef SCENE_1905109_H
+#define SCENE_1905109_H
+
+#include <string_view>
+#include <charconv>
+#include <cctype>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <map>
+#include "1905109_classes.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SCENE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+namespace offline2 {
+
+// Read-only view of a whole file. Mapped with mmap where available, read
+// into memory otherwise.
+struct MappedFile {
+    const char *data;
+    size_t size;
+    bool mapped;
+    vector<char> buffer;
+
+    MappedFile() {
+        data = nullptr;
+        size = 0;
+        mapped = false;
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+#ifdef SCENE_MMAP
+        if (mapped) munmap((void*)data, size);
+#endif
+    }
+
+    bool open(const char *fileName) {
+#ifdef SCENE_MMAP
+        int fd = ::open(fileName, O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat sb;
+        if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+            void *p = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, sb.st_size, MADV_SEQUENTIAL);
+                data = (const char*)p;
+                size = sb.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        if (mapped) return true;
+#endif
+        ifstream in(fileName, ios::binary);
+        if (!in) return false;
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+        return true;
+    }
+};
+
+
+// Whitespace separated tokens of a scene file, used like an istream:
+// rd >> word >> x >> y. Numbers go through from_chars, so no locale or
+// stream state is involved. A failed read leaves the reader false.
+struct SceneReader {
+    const char *cur, *end;
+    bool ok;
+
+    SceneReader(const char *data, size_t size) {
+        cur = data;
+        end = data + size;
+        ok = true;
+    }
+
+    const char *token(const char *&tokenEnd) {
+        while (cur < end && isspace((unsigned char)*cur)) cur++;
+        const char *begin = cur;
+        while (cur < end && !isspace((unsigned char)*cur)) cur++;
+        tokenEnd = cur;
+        if (begin == cur) ok = false;
+        return begin;
+    }
+
+    // skips whitespace; true when nothing but whitespace was left
+    bool atEnd() {
+        while (cur < end && isspace((unsigned char)*cur)) cur++;
+        return cur == end;
+    }
+
+    SceneReader &operator>>(string_view &w) {
+        const char *e, *b = token(e);
+        w = string_view(b, e-b);
+        return *this;
+    }
+
+    SceneReader &operator>>(double &v) {
+        const char *e, *b = token(e);
+        if (b < e && *b == '+') b++;
+        if (!ok || from_chars(b, e, v).ptr != e) ok = false;
+        return *this;
+    }
+
+    SceneReader &operator>>(long long &v) {
+        const char *e, *b = token(e);
+        if (b < e && *b == '+') b++;
+        if (!ok || from_chars(b, e, v).ptr != e) ok = false;
+        return *this;
+    }
+
+    bool operator!() {
+        return !ok;
+    }
+
+    explicit operator bool() {
+        return ok;
+    }
+};
+
+
+enum StageFormat { STAGE_TEXT, STAGE_BINARY, STAGE_BINARY32 };
+
+// Binary stage dump: this header, then 9 raw scalars per triangle (x y z of
+// its three vertices), float or double as scalarSize says. Native byte
+// order.
+struct StageHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t scalarSize;
+    uint32_t reserved;
+    uint64_t triangles;
+};
+
+const char stageMagic[4] = {'S', 'T', 'G', 'B'};
+
+
+inline void writeStageText(const char *fileName, vector<Triangle> &triangles) {
+    ofstream out;
+    out.open(fileName);
+
+    out << setprecision(6) << fixed;
+    for (Triangle &tr : triangles) {
+        for (int k = 0; k < 3; k++) {
+            out << tr.points[k].x << GAP << tr.points[k].y << GAP << tr.points[k].z << '\n';
+        }
+        out << '\n';
+    }
+
+    out.close();
+}
+
+
+template <typename T>
+void writeStageBinary(const char *fileName, vector<Triangle> &triangles) {
+    StageHeader h;
+    memcpy(h.magic, stageMagic, 4);
+    h.version = 1;
+    h.scalarSize = sizeof(T);
+    h.reserved = 0;
+    h.triangles = triangles.size();
+
+    vector<T> v;
+    v.reserve(triangles.size()*9);
+    for (Triangle &tr : triangles) {
+        for (int k = 0; k < 3; k++) {
+            v.push_back((T)tr.points[k].x);
+            v.push_back((T)tr.points[k].y);
+            v.push_back((T)tr.points[k].z);
+        }
+    }
+
+    ofstream out(fileName, ios::binary);
+    out.write((const char*)&h, sizeof(h));
+    out.write((const char*)v.data(), v.size()*sizeof(T));
+    out.close();
+}
+
+
+// <prefix>stage<n>.txt for text dumps, <prefix>stage<n>.bin otherwise
+inline void writeStage(const string &prefix, int stage, vector<Triangle> &triangles, StageFormat format) {
+    string name = prefix + "stage" + to_string(stage) + (format == STAGE_TEXT ? ".txt" : ".bin");
+
+    if (format == STAGE_TEXT) writeStageText(name.c_str(), triangles);
+    else if (format == STAGE_BINARY) writeStageBinary<double>(name.c_str(), triangles);
+    else writeStageBinary<float>(name.c_str(), triangles);
+}
+
+
+// A stage dump opened for reading. Binary dumps are used in place from the
+// mapping; text dumps are parsed into points.
+struct StageFile {
+    MappedFile file;
+    bool binary;
+    StageHeader header;
+    const char *vertices;
+    vector<Point> parsed;
+
+    bool open(const char *fileName) {
+        if (!file.open(fileName)) return false;
+
+        binary = file.size >= sizeof(StageHeader) && memcmp(file.data, stageMagic, 4) == 0;
+        if (binary) {
+            memcpy(&header, file.data, sizeof(header));
+            vertices = file.data + sizeof(header);
+            if (header.scalarSize != 4 && header.scalarSize != 8) return false;
+            return header.triangles <= (file.size - sizeof(header)) / (9*header.scalarSize);
+        }
+
+        SceneReader in(file.data, file.size);
+        Point p;
+        while (!in.atEnd()) {
+            if (!(in >> p.x >> p.y >> p.z)) return false;
+            parsed.push_back(p);
+        }
+        header.triangles = parsed.size()/3;
+        return parsed.size()%3 == 0;
+    }
+
+    size_t triangles() {
+        return header.triangles;
+    }
+
+    Point vertex(size_t i) {
+        if (!binary) return parsed[i];
+
+        double c[3];
+        for (int k = 0; k < 3; k++) {
+            if (header.scalarSize == 4) {
+                float f;
+                memcpy(&f, vertices + (i*3+k)*4, 4);
+                c[k] = f;
+            }
+            else {
+                memcpy(&c[k], vertices + (i*3+k)*8, 8);
+            }
+        }
+        return Point(c[0], c[1], c[2]);
+    }
+};
+
+
+// Rewrites a stage dump in the other format: text becomes binary (double
+// unless binary32 is asked for) and binary becomes the usual text layout.
+inline bool convertStage(const char *inName, const char *outName, StageFormat binaryFormat) {
+    StageFile in;
+    if (!in.open(inName)) return false;
+
+    vector<Triangle> triangles(in.triangles());
+    for (size_t t = 0; t < triangles.size(); t++) {
+        triangles[t].setPoints(in.vertex(t*3), in.vertex(t*3+1), in.vertex(t*3+2));
+    }
+
+    if (in.binary) writeStageText(outName, triangles);
+    else if (binaryFormat == STAGE_BINARY32) writeStageBinary<float>(outName, triangles);
+    else writeStageBinary<double>(outName, triangles);
+    return true;
+}
+
+struct Camera {
+    Point eye, look, up;
+    double fovY, aspect, near, far;
+};
+
+enum CommandType { CMD_TRIANGLE, CMD_TRANSLATE, CMD_SCALE, CMD_ROTATE, CMD_PUSH, CMD_POP, CMD_MESH, CMD_INSTANCE, CMD_REPEAT };
+
+// One scene.txt command. A triangle uses all three points, translate and
+// scale use p[0], rotate uses angle with its axis in p[0]. A mesh (from a
+// mesh or obj command) is Scene::meshes[index]; an instance runs the block
+// Scene::blocks[index] and a repeat runs it count times.
+struct SceneCommand {
+    CommandType type;
+    double angle;
+    Point p[3];
+    int index, count;
+};
+
+// matrix of a translate, scale or rotate command
+inline Matrix commandMatrix(SceneCommand &c) {
+    Matrix m;
+    if (c.type == CMD_TRANSLATE) m.translation(c.p[0]);
+    else if (c.type == CMD_SCALE) m.scaling(c.p[0]);
+    else m.rotate(c.p[0], c.angle);
+    return m;
+}
+
+// Indexed triangles: triangle t is vertices[indices[3t]], [3t+1], [3t+2].
+struct Mesh {
+    PointArray vertices;
+    vector<int> indices;
+
+    size_t triangles() {
+        return indices.size()/3;
+    }
+};
+
+// Bodies of define and repeat blocks are kept once in blocks and only
+// expanded when the scene is drawn. dir is the directory of the scene
+// file, which relative obj paths are taken from; sources lists the files
+// obj commands read, with dir applied.
+struct Scene {
+    Camera camera;
+    vector<SceneCommand> commands;
+    vector<Mesh> meshes;
+    vector<vector<SceneCommand>> blocks;
+    string dir;
+    vector<string> sources;
+};
+
+// "scenes/a/scene.txt" -> "scenes/a/", "scene.txt" -> ""
+inline string directoryOf(const char *fileName) {
+    const char *slash = strrchr(fileName, '/');
+#ifdef _WIN32
+    const char *back = strrchr(fileName, '\\');
+    if (back && (!slash || back > slash)) slash = back;
+#endif
+    return slash ? string(fileName, slash+1) : string();
+}
+
+// path as given when it is absolute, else taken from dir
+inline string resolvePath(const string &dir, string_view path) {
+    if (path.empty() || path[0] == '/' || dir.empty()) return string(path);
+    return dir + string(path);
+}
+
+// define names -> Scene::blocks
+typedef map<string, int, less<>> BlockNames;
+
+struct Config {
+    int screenWidth, screenHeight;
+
+    Config() {
+        screenWidth = screenHeight = 100;
+    }
+};
+
+
+inline bool readCamera(SceneReader &in, Camera &cam) {
+    in >> cam.eye.x >> cam.eye.y >> cam.eye.z;
+    in >> cam.look.x >> cam.look.y >> cam.look.z;
+    in >> cam.up.x >> cam.up.y >> cam.up.z;
+    in >> cam.fovY >> cam.aspect >> cam.near >> cam.far;
+    return (bool)in;
+}
+
+
+// Wavefront OBJ geometry: v lines become vertices and every f polygon is
+// fanned into triangles. Face corners may be v, v/vt, v//vn or v/vt/vn, and
+// negative indices count back from the last vertex. Everything else
+// (normals, texture coordinates, groups, materials) is ignored.
+inline bool loadObj(const char *fileName, Mesh &mesh) {
+    MappedFile file;
+    if (!file.open(fileName)) return false;
+
+    mesh.vertices.clear();
+    mesh.indices.clear();
+
+    const char *cur = file.data, *end = file.data + file.size;
+    vector<int> face;
+    while (cur < end) {
+        const char *lineEnd = (const char*)memchr(cur, '\n', end-cur);
+        if (!lineEnd) lineEnd = end;
+        SceneReader in(cur, lineEnd-cur);
+        cur = lineEnd+1;
+
+        string_view s;
+        in >> s;
+        if (s == "v") {
+            Point p;
+            in >> p.x >> p.y >> p.z;
+            if (!in) return false;
+            mesh.vertices.push_back(p);
+        }
+        else if (s == "f") {
+            face.clear();
+            while (true) {
+                string_view corner;
+                in >> corner;
+                if (!in) break;
+
+                long long v;
+                const char *b = corner.data(), *e = b + corner.size();
+                if (from_chars(b, e, v).ptr == b || v == 0) return false;
+                v = v > 0 ? v-1 : (long long)mesh.vertices.size()+v;
+                if (v < 0 || v >= (long long)mesh.vertices.size()) return false;
+                face.push_back((int)v);
+            }
+            for (size_t k = 2; k < face.size(); k++) {
+                mesh.indices.push_back(face[0]);
+                mesh.indices.push_back(face[k-1]);
+                mesh.indices.push_back(face[k]);
+            }
+        }
+    }
+
+    return true;
+}
+
+
+#define MESH_RESERVE (1 << 16)
+
+// Body of "mesh V T": V vertices, then T triangles of three zero based
+// vertex indices. refill(in) is called before every vertex and triangle,
+// for readers over a window of the file.
+template <typename F>
+bool readMesh(SceneReader &in, Mesh &mesh, F refill) {
+    long long nv, nt;
+    in >> nv >> nt;
+    if (!in || nv < 0 || nt < 0 || nv > INT_MAX || (unsigned long long)nt > SIZE_MAX/3) return false;
+
+    // reserve at most MESH_RESERVE up front: a stream can not tell how much
+    // text is left, so a bad header fails on the missing numbers instead of
+    // allocating for them
+    mesh.vertices.reserve(min(nv, (long long)MESH_RESERVE));
+    mesh.indices.reserve(min(nt, (long long)MESH_RESERVE)*3);
+    for (long long i = 0; i < nv; i++) {
+        refill(in);
+        Point p;
+        in >> p.x >> p.y >> p.z;
+        if (!in) return false;
+        mesh.vertices.push_back(p);
+    }
+    for (long long t = 0; t < nt; t++) {
+        refill(in);
+        for (int k = 0; k < 3; k++) {
+            long long v;
+            in >> v;
+            if (!in || v < 0 || v >= nv) return false;
+            mesh.indices.push_back((int)v);
+        }
+    }
+
+    return true;
+}
+
+
+template <typename F>
+bool readCommand(SceneReader &in, SceneCommand &c, bool &done, Scene &scene, BlockNames &names, F refill);
+
+// Commands up to the closing keyword, appended to block.
+template <typename F>
+bool readBlock(SceneReader &in, vector<SceneCommand> &block, string_view closing, Scene &scene, BlockNames &names, F refill) {
+    while (true) {
+        refill(in);
+        const char *mark = in.cur;
+        string_view s;
+        in >> s;
+        if (!in) return false;
+        if (s == closing) return true;
+        in.cur = mark;
+
+        SceneCommand c;
+        bool done;
+        if (!readCommand(in, c, done, scene, names, refill) || done) return false;
+        block.push_back(c);
+    }
+}
+
+
+// Reads the next command into c. Meshes and block bodies go into scene,
+// refill is passed on to readMesh and readBlock. A define is stored and
+// skipped, so c is always a command to run. done is set at "end" or the end
+// of the text; false on an unknown command or name, a malformed number, a
+// bad mesh or an unterminated block.
+//
+//   define NAME ... enddef      stores the commands as NAME
+//   instance NAME               runs them between an implied push and pop
+//   repeat N ... endrepeat      runs the commands N times, also between an
+//                               implied push and pop; transforms in them
+//                               carry over from one pass to the next
+template <typename F>
+bool readCommand(SceneReader &in, SceneCommand &c, bool &done, Scene &scene, BlockNames &names, F refill) {
+    string_view s;
+    in >> s;
+    while (in && s == "define") {
+        string_view view;
+        in >> view;
+        if (!in || names.count(view)) return false;
+        // refills inside the body move the buffer view points into
+        string name(view);
+
+        vector<SceneCommand> body;
+        if (!readBlock(in, body, "enddef", scene, names, refill)) return false;
+        names.emplace(move(name), (int)scene.blocks.size());
+        scene.blocks.push_back(move(body));
+
+        refill(in);
+        in >> s;
+    }
+    done = !in || s == "end";
+    if (done) return true;
+
+    if (s == "triangle") {
+        c.type = CMD_TRIANGLE;
+        for (int k = 0; k < 3; k++) {
+            in >> c.p[k].x >> c.p[k].y >> c.p[k].z;
+        }
+    }
+    else if (s == "translate") {
+        c.type = CMD_TRANSLATE;
+        in >> c.p[0].x >> c.p[0].y >> c.p[0].z;
+    }
+    else if (s == "scale") {
+        c.type = CMD_SCALE;
+        in >> c.p[0].x >> c.p[0].y >> c.p[0].z;
+    }
+    else if (s == "rotate") {
+        c.type = CMD_ROTATE;
+        in >> c.angle >> c.p[0].x >> c.p[0].y >> c.p[0].z;
+    }
+    else if (s == "push") {
+        c.type = CMD_PUSH;
+    }
+    else if (s == "pop") {
+        c.type = CMD_POP;
+    }
+    else if (s == "mesh" || s == "obj") {
+        c.type = CMD_MESH;
+        Mesh mesh;
+        if (s == "mesh") {
+            if (!readMesh(in, mesh, refill)) return false;
+        }
+        else {
+            string_view path;
+            in >> path;
+            if (!in) return false;
+            string source = resolvePath(scene.dir, path);
+            if (!loadObj(source.c_str(), mesh)) return false;
+            scene.sources.push_back(source);
+        }
+        c.index = scene.meshes.size();
+        scene.meshes.push_back(move(mesh));
+    }
+    else if (s == "instance") {
+        c.type = CMD_INSTANCE;
+        string_view name;
+        in >> name;
+        auto it = names.find(name);
+        if (!in || it == names.end()) return false;
+        c.index = it->second;
+    }
+    else if (s == "repeat") {
+        c.type = CMD_REPEAT;
+        long long n;
+        in >> n;
+        if (!in || n < 0 || n > INT32_MAX) return false;
+        c.count = (int)n;
+
+        vector<SceneCommand> body;
+        if (!readBlock(in, body, "endrepeat", scene, names, refill)) return false;
+        c.index = scene.blocks.size();
+        scene.blocks.push_back(move(body));
+    }
+    else {
+        return false;
+    }
+
+    return (bool)in;
+}
+
+
+// Parses scene.txt text. False on an unknown command or a malformed number.
+inline bool parseScene(const char *data, size_t size, Scene &scene, const string &dir = "") {
+    SceneReader in(data, size);
+    if (!readCamera(in, scene.camera)) return false;
+
+    scene.dir = dir;
+    scene.commands.clear();
+    scene.meshes.clear();
+    scene.blocks.clear();
+    scene.sources.clear();
+    BlockNames names;
+    while (true) {
+        SceneCommand c;
+        bool done;
+        if (!readCommand(in, c, done, scene, names, [](SceneReader &) {})) return false;
+        if (done) break;
+        scene.commands.push_back(c);
+    }
+
+    return true;
+}
+
+inline bool loadScene(const char *fileName, Scene &scene) {
+    MappedFile file;
+    if (!file.open(fileName)) return false;
+    return parseScene(file.data, file.size, scene, directoryOf(fileName));
+}
+
+
+#define STREAM_BUFFER (1 << 20)
+#define STREAM_MARGIN 4096
+
+// scene.txt read one command at a time through a fixed size buffer, for
+// scenes too big to hold as a command list. The buffer is topped up
+// whenever less than STREAM_MARGIN bytes are left, so a command (or a token
+// shorter than the margin) never straddles the end of it; meshes and
+// blocks are topped up between their vertices, triangles and commands.
+// Definitions, repeat bodies and their meshes are kept in defs; a mesh at
+// the top level may be dropped once drawn.
+struct SceneStream {
+    ifstream file;
+    vector<char> buffer;
+    size_t begin, end;
+    bool eof;
+    Scene defs;
+    BlockNames names;
+
+    bool open(const char *fileName, Camera &cam) {
+        file.open(fileName, ios::binary);
+        if (!file) return false;
+
+        buffer.resize(STREAM_BUFFER);
+        begin = end = 0;
+        eof = false;
+        defs.dir = directoryOf(fileName);
+
+        fill();
+        SceneReader in(buffer.data() + begin, end - begin);
+        if (!readCamera(in, cam)) return false;
+        begin = in.cur - buffer.data();
+        return true;
+    }
+
+    void fill() {
+        if (eof || end - begin >= STREAM_MARGIN) return;
+
+        memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+
+        file.read(buffer.data() + end, buffer.size() - end);
+        end += file.gcount();
+        eof = file.gcount() == 0 || !file;
+    }
+
+    // same contract as readCommand, with defs as the scene
+    bool next(SceneCommand &c, bool &done) {
+        fill();
+        SceneReader in(buffer.data() + begin, end - begin);
+        bool ok = readCommand(in, c, done, defs, names, [this](SceneReader &in) {
+            begin = in.cur - buffer.data();
+            fill();
+            in.cur = buffer.data() + begin;
+            in.end = buffer.data() + end;
+        });
+        begin = in.cur - buffer.data();
+        return ok;
+    }
+};
+
+
+inline bool parseConfig(const char *data, size_t size, Config &config) {
+    SceneReader in(data, size);
+    double w, h;
+    in >> w >> h;
+    if (!in || w < 1 || h < 1) return false;
+
+    config.screenWidth = (int)w;
+    config.screenHeight = (int)h;
+    return true;
+}
+
+inline bool loadConfig(const char *fileName, Config &config) {
+    MappedFile file;
+    if (!file.open(fileName)) return false;
+    return parseConfig(file.data, file.size, config);
+}
+
+
+
+// One entry of a camera list: a camera and the screen to render it on.
+struct View {
+    Camera camera;
+    Config config;
+};
+
+// Camera list file: per view, 15 numbers in scene.txt order, eye, look,
+// up, fovY aspect near far, then the screen width and height.
+inline bool loadViews(const char *fileName, vector<View> &views) {
+    MappedFile file;
+    if (!file.open(fileName)) return false;
+
+    SceneReader in(file.data, file.size);
+    views.clear();
+    while (true) {
+        View v;
+        Camera &cam = v.camera;
+        double w, h;
+
+        in >> cam.eye.x;
+        if (!in) break;
+        in >> cam.eye.y >> cam.eye.z;
+        in >> cam.look.x >> cam.look.y >> cam.look.z;
+        in >> cam.up.x >> cam.up.y >> cam.up.z;
+        in >> cam.fovY >> cam.aspect >> cam.near >> cam.far;
+        in >> w >> h;
+        if (!in || w < 1 || h < 1) return false;
+
+        v.config.screenWidth = (int)w;
+        v.config.screenHeight = (int)h;
+        views.push_back(v);
+    }
+
+    return !views.empty();
+}
+
+
+// One scene edit: a translate, scale or rotate applied in world space to
+// an object, i.e. to one top-level triangle, mesh, instance or repeat
+// command of the scene, counted from 0.
+struct Edit {
+    int object;
+    SceneCommand c;
+};
+
+// Edit list file: per edit the object, then the command as scene.txt
+// writes it, e.g. "3 translate 0 1 0".
+inline bool loadEdits(const char *fileName, vector<Edit> &edits) {
+    MappedFile file;
+    if (!file.open(fileName)) return false;
+
+    SceneReader in(file.data, file.size);
+    edits.clear();
+    while (true) {
+        Edit e;
+        long long object;
+        in >> object;
+        if (!in) break;
+
+        string_view s;
+        in >> s;
+        SceneCommand &c = e.c;
+        if (s == "translate") c.type = CMD_TRANSLATE;
+        else if (s == "scale") c.type = CMD_SCALE;
+        else if (s == "rotate") c.type = CMD_ROTATE;
+        else return false;
+
+        if (c.type == CMD_ROTATE) in >> c.angle;
+        in >> c.p[0].x >> c.p[0].y >> c.p[0].z;
+        if (!in || object < 0 || object > INT_MAX) return false;
+
+        e.object = (int)object;
+        edits.push_back(e);
+    }
+
+    return !edits.empty();
+}
+
+
+} // namespace offline2
+
+#endif